@@ -13,6 +13,7 @@
 
 #include <condition_variable>
 #include <mutex>
+#include <optional>
 
 struct BinaryContext;
 
@@ -25,18 +26,25 @@ struct Program;
 template <class T>
 struct CommandData
 {
+    // input graph, execution plan takes it over on creation
     std::unordered_set<std::shared_ptr<T>> dependencies;
 
-    std::atomic_size_t dependencies_left = 0;
-    std::unordered_set<std::shared_ptr<T>> dependendent_commands;
-
     size_t *current_command = nullptr;
     size_t total_commands = 0;
 
+    // estimated time of the longest path from this command to the end of the graph
+    uint64_t critical_path = 0;
+
     virtual ~CommandData() {}
 
     virtual void execute() = 0;
     virtual void prepare() = 0;
+    // in ms, used for scheduling only
+    virtual uint64_t getEstimatedTime() const { return 1; }
+    // scheduler takes resources before execute(), so commands
+    // waiting for them are parked and do not hold worker threads
+    virtual bool tryLockResources() { return true; }
+    virtual void unlockResources() {}
     //virtual String getName() const = 0;
 };
 
@@ -49,32 +57,74 @@ struct Command;
 
 using Commands = std::unordered_set<std::shared_ptr<builder::Command>>;
 
+// weighted semaphore, e.g. link jobs or memory in MB
 struct SW_BUILDER_API ResourcePool
 {
-    int n = -1; // unlimited
+    String name;
+    int capacity = -1; // unlimited, not changed after setLimit()
+    int n = -1; // units left, under m
     std::condition_variable cv;
     std::mutex m;
 
-    void lock()
+    ResourcePool() = default;
+    ResourcePool(const String &name, int capacity = -1)
+        : name(name)
+    {
+        setLimit(capacity);
+    }
+
+    // call before use
+    void setLimit(int c)
     {
-        if (n == -1)
+        capacity = n = c > 0 ? c : -1;
+    }
+
+    void lock(int w = 1)
+    {
+        if (capacity == -1)
             return;
+        w = clamp(w);
         std::unique_lock<std::mutex> lk(m);
-        cv.wait(lk, [this] { return n > 0; });
-        --n;
+        cv.wait(lk, [this, w] { return n >= w; });
+        n -= w;
     }
 
-    void unlock()
+    bool try_lock(int w = 1)
     {
-        if (n == -1)
+        if (capacity == -1)
+            return true;
+        w = clamp(w);
+        std::unique_lock<std::mutex> lk(m);
+        if (n < w)
+            return false;
+        n -= w;
+        return true;
+    }
+
+    void unlock(int w = 1)
+    {
+        if (capacity == -1)
             return;
+        w = clamp(w);
         std::unique_lock<std::mutex> lk(m);
-        ++n;
+        n += w;
         lk.unlock();
-        cv.notify_one();
+        cv.notify_all();
+    }
+
+private:
+    // heavier than the whole pool must still run, alone
+    int clamp(int w) const
+    {
+        return std::max(0, std::min(w, capacity));
     }
 };
 
+// named pools: "link", "lto", "memory" (MB) are limited from command line,
+// others are unlimited until setLimit() is called
+SW_BUILDER_API
+ResourcePool &getResourcePool(const String &name);
+
 namespace builder
 {
 
@@ -117,17 +167,33 @@ struct SW_BUILDER_API Command : Node, std::enable_shared_from_this<Command>,
     void execute() override { execute1(); }
     void execute(std::error_code &ec) override { execute1(&ec); }
     virtual void postProcess(bool ok = true) {}
+    // stdout while the process runs (when supported), may consume
+    // complete lines from the beginning of buf, the rest goes to out.text
+    virtual void processOutput(String &buf, bool eof) {}
     void clean() const;
     bool isExecuted() const { return pid != -1 || executed_; }
+    // allows to execute the command again in the same process
+    void resetExecution();
 
     //String getName() const override { return getName(false); }
     String getName(bool short_name = false) const;
     void printLog() const;
     path getProgram() const override;
-    virtual ResourcePool *getResourcePool() { return nullptr; }
+    // weight 0 for "memory" means peak memory of the previous run
+    void addResource(const String &pool, int weight = 1);
+    void addResource(ResourcePool &pool, int weight = 1);
+    // pool names with their weights as they were added
+    std::vector<std::pair<String, int>> getResources() const;
+    bool tryLockResources() override;
+    void unlockResources() override;
 
     virtual bool isOutdated() const;
     bool needsResponseFile() const;
+    uint64_t getEstimatedTime() const override;
+    // peak memory of the last run in MB, 0 if unknown
+    uint64_t getEstimatedMemory() const;
+    // used when there is no history for this command
+    virtual uint64_t getDefaultEstimatedTime() const { return 100; }
 
     void setProgram(const path &p);
     //void setProgram(const std::shared_ptr<Dependency> &d);
@@ -143,6 +209,10 @@ struct SW_BUILDER_API Command : Node, std::enable_shared_from_this<Command>,
     path redirectStdout(const path &p);
     path redirectStderr(const path &p);
     virtual bool isHashable() const { return true; }
+    // command can be shipped to remote workers
+    virtual bool isDistributable() const { return false; }
+    // files written besides outputs, like depfiles
+    virtual Files getSideOutputs() const { return {}; }
     virtual size_t getHash() const;
     size_t getHashAndSave() const;
     size_t calculateFilesHash() const;
@@ -161,7 +231,22 @@ protected:
     void addInputOutputDeps();
 
 private:
+    struct Resource
+    {
+        ResourcePool *pool;
+        int weight;
+        int locked = 0; // weight may change after execution, so keep the taken one
+    };
+    std::vector<Resource> resources;
+    bool resources_locked = false;
+    bool job_started = false;
+    // isOutdated() reports changes only once, so it is asked once per execution
+    std::optional<bool> outdated;
+
     void execute1(std::error_code *ec = nullptr);
+    bool checkOutdated();
+    int getResourceWeight(const Resource &r) const;
+    void lockResources();
 };
 
 }
@@ -217,6 +302,7 @@ struct SW_BUILDER_API _ExecuteCommand : builder::Command
     void execute() override;
     void prepare() override;
     size_t getHash() const override;
+    uint64_t getDefaultEstimatedTime() const override { return 10; }
     path getProgram() const override { return "ExecuteCommand"; };
 };
 
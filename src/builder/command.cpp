@@ -9,9 +9,13 @@
 #define BOOST_THREAD_VERSION 5
 #include <sw/builder/command.h>
 
+#include "command_cache.h"
 #include "command_storage.h"
+#include "distributed.h"
 #include "db.h"
+#include "job_control.h"
 #include "program.h"
+#include "spawner.h"
 
 #include <file_storage.h>
 #include <hash.h>
@@ -25,8 +29,13 @@
 #include <boost/algorithm/string.hpp>
 #include <boost/thread/thread_pool.hpp>
 
+#include <chrono>
 #include <iostream>
 
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
 #include <primitives/log.h>
 DECLARE_STATIC_LOGGER(logger, "command");
 
@@ -34,9 +43,41 @@ static cl::opt<bool> save_failed_commands("save-failed-commands");
 static cl::opt<bool> save_all_commands("save-all-commands");
 static cl::opt<bool> save_executed_commands("save-executed-commands");
 
+static cl::opt<int> link_jobs("link-jobs", cl::desc("Max number of simultaneous link jobs"));
+static cl::opt<int> lto_jobs("lto-jobs", cl::desc("Max number of simultaneous lto link jobs"));
+static cl::opt<int> memory_limit("memory-limit", cl::desc("Memory available for heavy commands (MB)"));
+
 namespace sw
 {
 
+static std::atomic_size_t running_commands;
+static std::atomic_size_t started_commands;
+
+struct ChildrenUsage
+{
+    uint64_t cpu_time = 0; // ms
+    uint64_t peak_rss = 0; // kb
+};
+
+static ChildrenUsage getChildrenUsage()
+{
+    ChildrenUsage u;
+#ifndef _WIN32
+    rusage ru;
+    if (getrusage(RUSAGE_CHILDREN, &ru) != 0)
+        return u;
+    u.cpu_time =
+        (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000 +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+#ifdef __APPLE__
+    u.peak_rss = ru.ru_maxrss / 1024; // bytes
+#else
+    u.peak_rss = ru.ru_maxrss;
+#endif
+#endif
+    return u;
+}
+
 CommandStorage &getCommandStorage()
 {
     static CommandStorage cs;
@@ -84,7 +125,7 @@ bool CommandStorage::isOutdated(const sw::builder::Command &c)
         changed |= File(i, *c.fs).isChanged();
 
     auto k = std::hash<sw::builder::Command>()(c);
-    auto r = commands.insert_ptr(k, 0);
+    auto r = commands.insert_ptr(k);
     if (r.second)
     {
         // we have insertion, no previous value available
@@ -124,7 +165,7 @@ bool CommandStorage::isOutdated(const sw::builder::Command &c)
 
     // we don't see changes, now check command hash
     if (!r.second)
-        return *r.first != c.calculateFilesHash();
+        return r.first->hash != c.calculateFilesHash();
 
     return false;
 }
@@ -192,9 +233,32 @@ void Command::updateFilesHash() const
 {
     auto h = calculateFilesHash();
     auto k = std::hash<Command>()(*this);
-    auto r = getCommandStorage().commands.insert_ptr(k, h);
-    if (!r.second)
-        *r.first = h;
+    auto r = getCommandStorage().commands.insert_ptr(k);
+    r.first->hash = h;
+}
+
+uint64_t Command::getEstimatedTime() const
+{
+    if (auto r = getCommandStorage().commands.find(std::hash<Command>()(*this)); r && r->wall_time)
+        return r->wall_time;
+    return getDefaultEstimatedTime();
+}
+
+uint64_t Command::getEstimatedMemory() const
+{
+    if (auto r = getCommandStorage().commands.find(std::hash<Command>()(*this)); r)
+        return r->peak_rss / 1024;
+    return 0;
+}
+
+void Command::resetExecution()
+{
+    executed_ = false;
+    outdated.reset();
+    pid = -1;
+    exit_code.reset();
+    out.text.clear();
+    err.text.clear();
 }
 
 void Command::clean() const
@@ -337,11 +401,119 @@ void Command::prepare()
     prepared = true;
 }
 
+ResourcePool &getResourcePool(const String &name)
+{
+    static std::mutex m;
+    static std::unordered_map<String, std::unique_ptr<ResourcePool>> pools;
+
+    std::unique_lock<std::mutex> lk(m);
+    auto &p = pools[name];
+    if (!p)
+    {
+        int limit = -1;
+        if (name == "link")
+            limit = link_jobs;
+        else if (name == "lto")
+            limit = lto_jobs;
+        else if (name == "memory")
+            limit = memory_limit;
+        p = std::make_unique<ResourcePool>(name, limit);
+    }
+    return *p;
+}
+
+void Command::addResource(const String &pool, int weight)
+{
+    addResource(getResourcePool(pool), weight);
+}
+
+void Command::addResource(ResourcePool &pool, int weight)
+{
+    resources.push_back({ &pool, weight });
+}
+
+std::vector<std::pair<String, int>> Command::getResources() const
+{
+    std::vector<std::pair<String, int>> v;
+    for (auto &r : resources)
+        v.emplace_back(r.pool->name, r.weight);
+    return v;
+}
+
+int Command::getResourceWeight(const Resource &r) const
+{
+    if (r.weight || r.pool->name != "memory")
+        return r.weight;
+    if (auto m = getEstimatedMemory())
+        return (int)m;
+    // no history, take a quarter of the pool
+    return std::max(1, r.pool->capacity / 4);
+}
+
+bool Command::tryLockResources()
+{
+    auto jc = getJobControl();
+    if (resources_locked || (resources.empty() && !jc))
+        return true;
+    // up to date commands do not need anything
+    prepare();
+    if (!checkOutdated())
+        return true;
+    auto i = resources.begin();
+    for (; i != resources.end(); ++i)
+    {
+        i->locked = getResourceWeight(*i);
+        if (!i->pool->try_lock(i->locked))
+            break;
+    }
+    // system is asked last, when we are sure to start
+    if (i == resources.end() && (!jc || jc->tryStart(getEstimatedMemory())))
+    {
+        job_started = jc;
+        resources_locked = true;
+        return true;
+    }
+    // all or nothing
+    for (auto j = resources.begin(); j != i; ++j)
+        j->pool->unlock(j->locked);
+    return false;
+}
+
+void Command::lockResources()
+{
+    // pools are always taken in the same order, no deadlocks between direct callers
+    for (auto &r : resources)
+    {
+        r.locked = getResourceWeight(r);
+        r.pool->lock(r.locked);
+    }
+    resources_locked = true;
+}
+
+void Command::unlockResources()
+{
+    if (!resources_locked)
+        return;
+    for (auto &r : resources)
+        r.pool->unlock(r.locked);
+    if (job_started)
+        getJobControl()->finish();
+    job_started = false;
+    resources_locked = false;
+}
+
+bool Command::checkOutdated()
+{
+    if (!outdated)
+        outdated = isOutdated();
+    return *outdated;
+}
+
 void Command::execute1(std::error_code *ec)
 {
     prepare();
 
-    if (!isOutdated())
+    if (!checkOutdated())
     {
         executed_ = true;
         return;
@@ -356,6 +528,64 @@ void Command::execute1(std::error_code *ec)
 
     printLog();
 
+    auto update_outputs = [this]()
+    {
+        // force outputs update
+        /*for (auto &i : inputs)
+        {
+            auto &fr = f.getFileRecord();
+            fr.refreshed = false;
+            fr.isChanged();
+        }*/
+        for (auto &i : intermediate)
+        {
+            File f(i, *fs);
+            /*if (!fs::exists(i))
+                f.getFileRecord().flags.set(ffNotExists);
+            else*/
+            //f.getFileRecord().load();
+            auto &fr = f.getFileRecord();
+            fr.data->refreshed = false;
+            fr.data->stat_ready = false;
+            fr.isChanged();
+            fr.updateLwt();
+        }
+        for (auto &i : outputs)
+        {
+            File f(i, *fs);
+            /*if (!fs::exists(i))
+                f.getFileRecord().flags.set(ffNotExists);
+            else*/
+            //f.getFileRecord().load();
+            auto &fr = f.getFileRecord();
+            fr.data->refreshed = false;
+            fr.data->stat_ready = false;
+            fr.isChanged();
+            fr.updateLwt();
+            fr.updateContentHash();
+        }
+
+        updateFilesHash();
+    };
+
+    bool cacheable = CommandCache::isEnabled() && CommandCache::isCacheable(*this);
+    if (cacheable)
+    {
+        if (getCommandCache().restore(*this))
+        {
+            update_outputs();
+            return;
+        }
+
+        // outputs restored by older versions are hardlinks into the cache, do not let tools write through them
+        error_code ec;
+        for (auto &o : outputs)
+        {
+            if (fs::hard_link_count(o, ec) > 1 && !ec)
+                fs::remove(o, ec);
+        }
+    }
+
     if (remove_outputs_before_execution)
     {
         // Some programs won't update their binaries even in case of updated sources/deps.
@@ -368,14 +598,14 @@ void Command::execute1(std::error_code *ec)
     //static std::atomic_int n = 0;
     //LOG_INFO(logger, "command #" << ++n << " is outdated: " + getName());
 
-    // check our resources
-    auto rp = getResourcePool();
-    if (rp)
-        rp->lock();
+    // check our resources, execution plan takes them before calling us
+    bool lock_resources = !resources_locked;
+    if (lock_resources)
+        lockResources();
     SCOPE_EXIT
     {
-        if (rp)
-            rp->unlock();
+        if (lock_resources)
+            unlockResources();
     };
 
     // Try to construct command line first.
@@ -534,20 +764,75 @@ void Command::execute1(std::error_code *ec)
     //LOG_INFO(logger, print());
     LOG_TRACE(logger, print());
 
+    auto start = std::chrono::steady_clock::now();
+    auto usage_start = getChildrenUsage();
+    auto running_start = running_commands++;
+    auto started_start = started_commands++;
+    bool ok = false;
+    // exact usage of our own process
+    bool spawned = false;
+    ProcessUsage usage;
+    SCOPE_EXIT
+    {
+        running_commands--;
+
+        auto &r = *getCommandStorage().commands.insert_ptr(std::hash<Command>()(*this)).first;
+        r.wall_time = (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+        r.exit_code = ok ? 0 : exit_code.value_or(-1);
+
+        if (spawned)
+        {
+            r.cpu_time = usage.cpu_time;
+            r.peak_rss = usage.peak_rss;
+        }
+        // children usage is process wide, so it belongs to us
+        // only if nobody else was running meanwhile
+        else if (running_start == 0 && started_commands == started_start + 1)
+        {
+            auto u = getChildrenUsage();
+            r.cpu_time = u.cpu_time - usage_start.cpu_time;
+            if (u.peak_rss > usage_start.peak_rss)
+                r.peak_rss = u.peak_rss;
+        }
+    };
+
     try
     {
-        if (ec)
+        // distributable commands go to remote workers first
+        auto d = getDispatcher();
+        if (!d || !isDistributable() || !d->execute(*this, rsp_file))
         {
-            Base::execute(*ec);
+            // executor is oversubscribed for remote jobs, keep local load as is
+            if (d)
+                d->local.lock();
+            SCOPE_EXIT
+            {
+                if (d)
+                    d->local.unlock();
+            };
+
+            auto on_output = [this](String &buf, bool eof) { processOutput(buf, eof); };
             if (ec)
             {
-                // TODO: save error string
-                make_error_string("FIXME");
-                return;
+                spawned = spawn(*this, ec, usage, on_output);
+                if (!spawned)
+                    Base::execute(*ec);
+                if (ec)
+                {
+                    // TODO: save error string
+                    make_error_string("FIXME");
+                    return;
+                }
+            }
+            else
+            {
+                spawned = spawn(*this, nullptr, usage, on_output);
+                if (!spawned)
+                    Base::execute();
             }
         }
-        else
-            Base::execute();
+        ok = true;
 
         if (save_executed_commands || save_all_commands)
         {
@@ -557,39 +842,10 @@ void Command::execute1(std::error_code *ec)
 
         postProcess(); // process deps
 
-        // force outputs update
-        /*for (auto &i : inputs)
-        {
-            auto &fr = f.getFileRecord();
-            fr.refreshed = false;
-            fr.isChanged();
-        }*/
-        for (auto &i : intermediate)
-        {
-            File f(i, *fs);
-            /*if (!fs::exists(i))
-                f.getFileRecord().flags.set(ffNotExists);
-            else*/
-            //f.getFileRecord().load();
-            auto &fr = f.getFileRecord();
-            fr.data->refreshed = false;
-            fr.isChanged();
-            fr.updateLwt();
-        }
-        for (auto &i : outputs)
-        {
-            File f(i, *fs);
-            /*if (!fs::exists(i))
-                f.getFileRecord().flags.set(ffNotExists);
-            else*/
-            //f.getFileRecord().load();
-            auto &fr = f.getFileRecord();
-            fr.data->refreshed = false;
-            fr.isChanged();
-            fr.updateLwt();
-        }
+        update_outputs();
 
-        updateFilesHash();
+        if (cacheable)
+            getCommandCache().store(*this);
     }
     catch (std::exception &e)
     {
@@ -0,0 +1,589 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "command_cache.h"
+
+#include "file.h"
+#include "remote_cache.h"
+
+#include <directories.h>
+#include <hash.h>
+
+#include <primitives/executor.h>
+#include <primitives/sw/settings.h>
+#include <primitives/templates.h>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "command.cache");
+
+#define COMMAND_CACHE_FORMAT_VERSION 1
+#define COMMAND_CACHE_KEY_LENGTH 32
+#define COMMAND_CACHE_MAX_ENTRIES 16
+#define COMMAND_CACHE_MAX_UPLOADS 64
+#define COMMAND_CACHE_TRANSFER_THREADS 8
+
+static cl::opt<bool> use_command_cache("command-cache", cl::desc("Reuse outputs of identical commands from local cache"));
+static cl::opt<String> command_cache_url("command-cache-url", cl::desc("Share command outputs through remote http cache"));
+
+namespace sw
+{
+
+using Dependencies = std::vector<std::pair<path, String>>;
+
+struct CommandCache::Entry
+{
+    String key;
+    Dependencies deps;
+};
+
+using Entries = std::vector<CommandCache::Entry>;
+
+static const String missing_file_hash = "-";
+
+String getContentHash(const path &p)
+{
+    static std::mutex m;
+    static std::unordered_map<path, std::tuple<fs::file_time_type, uintmax_t, String>> hashes;
+
+    // directories and missing files are hashed as missing
+    error_code ec;
+    if (!fs::is_regular_file(p, ec))
+        return missing_file_hash;
+    auto t = fs::last_write_time(p, ec);
+    if (ec)
+        return missing_file_hash;
+    auto sz = fs::file_size(p, ec);
+    if (ec)
+        return missing_file_hash;
+
+    {
+        std::unique_lock<std::mutex> lk(m);
+        auto i = hashes.find(p);
+        if (i != hashes.end() && std::get<0>(i->second) == t && std::get<1>(i->second) == sz)
+            return std::get<2>(i->second);
+    }
+
+    auto h = strong_file_hash(p);
+    std::unique_lock<std::mutex> lk(m);
+    hashes[p] = { t, sz, h };
+    return h;
+}
+
+static std::set<path> sorted(const Files &files)
+{
+    return { files.begin(), files.end() };
+}
+
+static bool matches(const CommandCache::Entry &e)
+{
+    return std::all_of(e.deps.begin(), e.deps.end(),
+        [](auto &d) { return getContentHash(d.first) == d.second; });
+}
+
+static String getEntryKey(const String &key, const Dependencies &deps)
+{
+    String s = key + "\n";
+    for (auto &[p, h] : deps)
+        s += h + " " + p.u8string() + "\n";
+    return shorten_hash(blake2b_512(s), COMMAND_CACHE_KEY_LENGTH);
+}
+
+// keys become path components and urls, remote ones must not escape the cache
+static bool isValidKey(const String &key)
+{
+    return key.size() == COMMAND_CACHE_KEY_LENGTH &&
+        std::all_of(key.begin(), key.end(), [](auto c) { return isdigit((unsigned char)c) || (c >= 'a' && c <= 'f'); });
+}
+
+static Entries parseManifest(const String &data)
+{
+    Entries entries;
+    std::istringstream ss(data);
+    String line;
+    while (std::getline(ss, line))
+    {
+        auto p = line.find(' ');
+        if (p == line.npos)
+            break;
+        CommandCache::Entry e;
+        e.key = line.substr(0, p);
+        if (!isValidKey(e.key))
+            throw std::runtime_error("Bad command cache manifest");
+        auto n = std::stoull(line.substr(p + 1));
+        for (size_t i = 0; i < n && std::getline(ss, line); i++)
+        {
+            p = line.find(' ');
+            if (p == line.npos)
+                throw std::runtime_error("Bad command cache manifest");
+            e.deps.emplace_back(fs::u8path(line.substr(p + 1)), line.substr(0, p));
+        }
+        if (e.deps.size() != n)
+            throw std::runtime_error("Bad command cache manifest");
+        entries.push_back(std::move(e));
+    }
+    return entries;
+}
+
+static String printManifest(const Entries &entries)
+{
+    String s;
+    for (auto &e : entries)
+    {
+        s += e.key + " " + std::to_string(e.deps.size()) + "\n";
+        for (auto &[p, h] : e.deps)
+            s += h + " " + p.u8string() + "\n";
+    }
+    return s;
+}
+
+static void mergeManifest(Entries &entries, const CommandCache::Entry &e)
+{
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+        [&e](auto &e2) { return e2.key == e.key; }), entries.end());
+    entries.insert(entries.begin(), e);
+    if (entries.size() > COMMAND_CACHE_MAX_ENTRIES)
+        entries.resize(COMMAND_CACHE_MAX_ENTRIES);
+}
+
+static path getTemporaryPath(const path &p)
+{
+    return p.parent_path() / ("tmp." + unique_path().u8string());
+}
+
+// object is a directory of plain files, pack them for transfer as
+// name size, name, data size, data
+static String pack(const path &dir)
+{
+    String s;
+    auto add = [&s](const void *p, size_t n)
+    {
+        s.append((const char *)p, n);
+    };
+    for (auto &f : fs::directory_iterator(dir))
+    {
+        auto name = f.path().filename().u8string();
+        auto data = read_file(f.path());
+        uint32_t nsz = (uint32_t)name.size();
+        uint64_t dsz = data.size();
+        add(&nsz, sizeof(nsz));
+        add(name.data(), name.size());
+        add(&dsz, sizeof(dsz));
+        add(data.data(), data.size());
+    }
+    return s;
+}
+
+static void unpack(const String &s, const path &dir)
+{
+    size_t pos = 0;
+    auto get = [&s, &pos](void *p, size_t n)
+    {
+        if (s.size() - pos < n)
+            throw std::runtime_error("Bad command cache object");
+        memcpy(p, s.data() + pos, n);
+        pos += n;
+    };
+
+    auto tmp = getTemporaryPath(dir);
+    fs::create_directories(tmp);
+    try
+    {
+        while (pos < s.size())
+        {
+            uint32_t nsz;
+            get(&nsz, sizeof(nsz));
+            String name(nsz, 0);
+            get(name.data(), nsz);
+            uint64_t dsz;
+            get(&dsz, sizeof(dsz));
+            String data(dsz, 0);
+            get(data.data(), dsz);
+
+            // names come from the network
+            if (name.empty() || !std::all_of(name.begin(), name.end(), [](auto c) { return isalnum((unsigned char)c); }))
+                throw std::runtime_error("Bad command cache object");
+            write_file(tmp / name, data);
+        }
+    }
+    catch (...)
+    {
+        error_code ec;
+        fs::remove_all(tmp, ec);
+        throw;
+    }
+    error_code ec;
+    fs::rename(tmp, dir, ec);
+    if (ec)
+        fs::remove_all(tmp, ec);
+}
+
+static void writeManifest(const path &fn, const Entries &entries)
+{
+    // concurrent writers may lose an entry, but never break the manifest
+    fs::create_directories(fn.parent_path());
+    auto tmp = getTemporaryPath(fn);
+    write_file(tmp, printManifest(entries));
+    error_code ec;
+    fs::rename(tmp, fn, ec);
+    if (ec)
+        fs::remove(tmp, ec);
+}
+
+static void restoreFile(const path &from, const path &to)
+{
+    error_code ec;
+    fs::remove(to, ec);
+    fs::create_directories(to.parent_path());
+    // not a hardlink: tools may write outputs in place, and the time below
+    // would be set on the cache object too
+    fs::copy_file(from, to);
+    // cached files are old, do not confuse other tools
+    fs::last_write_time(to, fs::file_time_type::clock::now());
+}
+
+CommandCache::CommandCache(const path &root, const String &url)
+    : root(root)
+{
+    if (url.empty())
+        return;
+    remote = std::make_unique<RemoteCache>(url);
+    transfers = std::make_unique<Executor>(COMMAND_CACHE_TRANSFER_THREADS);
+}
+
+CommandCache::~CommandCache()
+{
+    // let started uploads finish
+    if (transfers)
+        transfers->wait();
+}
+
+bool CommandCache::isEnabled()
+{
+    return use_command_cache || !command_cache_url.empty();
+}
+
+bool CommandCache::isCacheable(const builder::Command &c)
+{
+    // intermediate files (like pdbs) are often shared between commands
+    return !c.always && c.isHashable() && !c.outputs.empty() && c.intermediate.empty();
+}
+
+String CommandCache::getKey(const builder::Command &c) const
+{
+    String s = std::to_string(COMMAND_CACHE_FORMAT_VERSION) + "\n";
+    s += std::to_string(c.getHash()) + "\n";
+
+    // hash does not respect args order, wdir and env
+    for (auto &a : c.args)
+        s += a + "\n";
+    s += c.working_directory.u8string() + "\n";
+    for (auto &[k, v] : std::map<String, String>(c.environment.begin(), c.environment.end()))
+        s += k + "=" + v + "\n";
+
+    s += getContentHash(c.program) + " " + c.program.u8string() + "\n";
+    for (auto &i : sorted(c.inputs))
+        s += getContentHash(i) + " " + i.u8string() + "\n";
+    for (auto &o : sorted(c.outputs))
+        s += o.u8string() + "\n";
+    return shorten_hash(blake2b_512(s), COMMAND_CACHE_KEY_LENGTH);
+}
+
+path CommandCache::getManifestFilename(const String &key) const
+{
+    return root / "m" / key.substr(0, 2) / key;
+}
+
+path CommandCache::getObjectDir(const String &key) const
+{
+    if (!isValidKey(key))
+        throw std::logic_error("Bad command cache key: " + key);
+    return root / "o" / key.substr(0, 2) / key;
+}
+
+bool CommandCache::restoreLocal(builder::Command &c, const String &key) const
+{
+    auto mf = getManifestFilename(key);
+    if (!fs::exists(mf))
+        return false;
+
+    for (auto &e : parseManifest(read_file(mf)))
+    {
+        if (!matches(e))
+            continue;
+
+        auto dir = getObjectDir(e.key);
+        if (!fs::exists(dir))
+            continue;
+
+        int i = 0;
+        for (auto &o : sorted(c.outputs))
+            restoreFile(dir / std::to_string(i++), o);
+        if (fs::exists(dir / "stdout"))
+            c.out.text = read_file(dir / "stdout");
+        if (fs::exists(dir / "stderr"))
+            c.err.text = read_file(dir / "stderr");
+
+        // same as postProcess() does after real execution
+        for (auto &o : c.outputs)
+        {
+            for (auto &[p, h] : e.deps)
+                File(o, *c.fs).addImplicitDependency(p);
+        }
+
+        LOG_TRACE(logger, "cache hit: " + c.getName());
+        return true;
+    }
+    return false;
+}
+
+bool CommandCache::restore(builder::Command &c) const
+{
+    try
+    {
+        auto key = getKey(c);
+        if (restoreLocal(c, key))
+            return true;
+        if (!remote || remote_failed)
+            return false;
+
+        // wait for the lookup started ahead or do it now
+        std::shared_future<void> f;
+        {
+            std::unique_lock<std::mutex> lk(m);
+            auto i = lookups.find(key);
+            if (i != lookups.end())
+                f = i->second;
+        }
+        if (f.valid())
+            f.wait();
+        else
+            fetch(key);
+        return restoreLocal(c, key);
+    }
+    catch (std::exception &e)
+    {
+        LOG_DEBUG(logger, "Cannot restore command outputs from cache: " << e.what());
+    }
+    return false;
+}
+
+void CommandCache::addEntry(const String &key, const Entry &e) const
+{
+    auto mf = getManifestFilename(key);
+    Entries entries;
+    if (fs::exists(mf))
+        entries = parseManifest(read_file(mf));
+    mergeManifest(entries, e);
+    writeManifest(mf, entries);
+}
+
+void CommandCache::store(const builder::Command &c) const
+{
+    try
+    {
+        auto key = getKey(c);
+
+        // implicit dependencies are known only after execution
+        std::set<path> deps;
+        for (auto &o : c.outputs)
+        {
+            for (auto &[id, d] : File(o, *c.fs).getFileRecord().implicit_dependencies)
+            {
+                auto &p = getInternedPath(id);
+                if (c.inputs.find(p) == c.inputs.end())
+                    deps.insert(p);
+            }
+        }
+
+        Entry e;
+        for (auto &p : deps)
+            e.deps.emplace_back(p, getContentHash(p));
+        e.key = getEntryKey(key, e.deps);
+
+        auto dir = getObjectDir(e.key);
+        if (!fs::exists(dir))
+        {
+            // cache must own its bytes, outputs might be rewritten in place later
+            auto tmp = getTemporaryPath(dir);
+            fs::create_directories(tmp);
+            try
+            {
+                int i = 0;
+                for (auto &o : sorted(c.outputs))
+                    fs::copy_file(o, tmp / std::to_string(i++));
+                if (!c.out.text.empty())
+                    write_file(tmp / "stdout", c.out.text);
+                if (!c.err.text.empty())
+                    write_file(tmp / "stderr", c.err.text);
+            }
+            catch (...)
+            {
+                error_code ec;
+                fs::remove_all(tmp, ec);
+                throw;
+            }
+            error_code ec;
+            fs::rename(tmp, dir, ec);
+            if (ec)
+                fs::remove_all(tmp, ec);
+        }
+
+        addEntry(key, e);
+        upload(key, e);
+    }
+    catch (std::exception &e)
+    {
+        LOG_DEBUG(logger, "Cannot store command outputs in cache: " << e.what());
+    }
+}
+
+void CommandCache::fetch(const String &key) const
+{
+    if (remote_failed)
+        return;
+
+    try
+    {
+        String data;
+        if (!remote->get("m/" + key, data))
+            return;
+        for (auto &e : parseManifest(data))
+        {
+            if (!matches(e))
+                continue;
+            auto dir = getObjectDir(e.key);
+            if (!fs::exists(dir))
+            {
+                if (!remote->get("o/" + e.key, data))
+                    continue;
+                unpack(data, dir);
+            }
+            addEntry(key, e);
+            return;
+        }
+    }
+    catch (std::exception &e)
+    {
+        disableRemote(e.what());
+    }
+}
+
+void CommandCache::upload(const String &key, const Entry &e) const
+{
+    if (!remote || remote_failed)
+        return;
+
+    // never make commands wait for the network, drop uploads instead
+    if (uploads++ >= COMMAND_CACHE_MAX_UPLOADS)
+    {
+        uploads--;
+        LOG_TRACE(logger, "too many uploads, skipping " + e.key);
+        return;
+    }
+
+    transfers->push([this, key, e]
+    {
+        SCOPE_EXIT
+        {
+            uploads--;
+        };
+        if (remote_failed)
+            return;
+        try
+        {
+            // object goes first, manifest must not point to missing data
+            remote->put("o/" + e.key, pack(getObjectDir(e.key)));
+
+            String data;
+            Entries entries;
+            if (remote->get("m/" + key, data))
+                entries = parseManifest(data);
+            mergeManifest(entries, e);
+            remote->put("m/" + key, printManifest(entries));
+        }
+        catch (std::exception &e)
+        {
+            disableRemote(e.what());
+        }
+    });
+}
+
+void CommandCache::prefetch(const std::vector<std::shared_ptr<builder::Command>> &commands)
+{
+    if (!remote || remote_failed)
+        return;
+
+    std::vector<builder::Command *> cmds;
+    for (auto &c : commands)
+    {
+        if (!isCacheable(*c))
+            continue;
+        // do not touch network on up to date builds
+        if (std::all_of(c->outputs.begin(), c->outputs.end(), [](auto &o) { return fs::exists(o); }))
+            continue;
+        // keys depend on contents of generated files, they are not known yet
+        if (File(c->program, *c->fs).isGenerated() ||
+            std::any_of(c->inputs.begin(), c->inputs.end(), [&c](auto &i) { return File(i, *c->fs).isGenerated(); }))
+            continue;
+        cmds.push_back(c.get());
+    }
+
+    // keys are calculated before execution starts, commands change their args during it
+    std::vector<String> keys(cmds.size());
+    {
+        auto &e = getExecutor();
+        const size_t batch = 64;
+        Futures<void> futures;
+        for (size_t i = 0; i < cmds.size(); i += batch)
+        {
+            futures.push_back(e.push([&, i]
+            {
+                for (size_t j = i; j < std::min<size_t>(i + batch, cmds.size()); j++)
+                    keys[j] = getKey(*cmds[j]);
+            }));
+        }
+        waitAndGet(futures);
+    }
+
+    std::unique_lock<std::mutex> lk(m);
+    for (auto &k : keys)
+    {
+        if (lookups.find(k) != lookups.end() || fs::exists(getManifestFilename(k)))
+            continue;
+        auto p = std::make_shared<std::promise<void>>();
+        lookups[k] = p->get_future().share();
+        transfers->push([this, k, p]
+        {
+            SCOPE_EXIT
+            {
+                p->set_value();
+            };
+            fetch(k);
+        });
+    }
+}
+
+void CommandCache::disableRemote(const String &error) const
+{
+    bool f = false;
+    if (remote_failed.compare_exchange_strong(f, true))
+        LOG_WARN(logger, "Remote command cache is disabled: " << error);
+}
+
+CommandCache &getCommandCache()
+{
+    static CommandCache cc(getDirectories().storage_dir / "cache" / "commands", command_cache_url);
+    return cc;
+}
+
+}
@@ -0,0 +1,69 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <sw/builder/command.h>
+
+#include <future>
+
+namespace sw
+{
+
+struct RemoteCache;
+
+/// local content addressed store of command outputs
+///
+/// Lookup is done in two steps. Manifest is keyed by the command line
+/// and contents of the program and explicit inputs. It lists entries
+/// with implicit dependencies (headers) seen for this key on previous runs.
+/// Entry whose dependencies have the same contents points to stored outputs.
+///
+/// When remote cache is set, local misses are looked up there
+/// and new entries are uploaded in background.
+struct CommandCache
+{
+    struct Entry;
+
+    CommandCache(const path &root, const String &url = {});
+    ~CommandCache();
+
+    /// restores outputs, stdout and stderr, returns false on miss
+    bool restore(builder::Command &c) const;
+    /// saves outputs of successfully executed command
+    void store(const builder::Command &c) const;
+    /// starts remote lookups of commands before they are executed
+    void prefetch(const std::vector<std::shared_ptr<builder::Command>> &commands);
+
+    static bool isEnabled();
+    static bool isCacheable(const builder::Command &c);
+
+private:
+    path root;
+    std::unique_ptr<RemoteCache> remote;
+    std::unique_ptr<Executor> transfers;
+    mutable std::atomic_size_t uploads{ 0 };
+    mutable std::atomic_bool remote_failed{ false };
+    mutable std::mutex m;
+    mutable std::unordered_map<String, std::shared_future<void>> lookups;
+
+    String getKey(const builder::Command &c) const;
+    path getManifestFilename(const String &key) const;
+    path getObjectDir(const String &key) const;
+    bool restoreLocal(builder::Command &c, const String &key) const;
+    void addEntry(const String &key, const Entry &e) const;
+    void fetch(const String &key) const;
+    void upload(const String &key, const Entry &e) const;
+    void disableRemote(const String &error) const;
+};
+
+CommandCache &getCommandCache();
+
+/// memoized content hash of a file, "-" for missing ones
+SW_BUILDER_API
+String getContentHash(const path &p);
+
+}
@@ -13,7 +13,18 @@
 namespace sw
 {
 
-using ConcurrentCommandStorage = ConcurrentMapSimple<size_t>;
+struct CommandRecord
+{
+    size_t hash = 0;
+
+    // last execution
+    uint64_t wall_time = 0; // ms
+    uint64_t cpu_time = 0; // ms
+    uint64_t peak_rss = 0; // kb
+    int exit_code = 0;
+};
+
+using ConcurrentCommandStorage = ConcurrentMapSimple<CommandRecord>;
 
 struct CommandStorage
 {
@@ -8,7 +8,110 @@
 
 #include <junction/ConcurrentMap_Leapfrog.h>
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
+#include <mutex>
+#include <new>
+
+struct ConcurrentArenaStats
+{
+    size_t values = 0;
+    size_t chunks = 0;
+    size_t bytes = 0;
+};
+
+/// values live until the whole arena is released, there is no per value free
+template <class T>
+struct ConcurrentArena
+{
+    ConcurrentArena() = default;
+    ConcurrentArena(const ConcurrentArena &) = delete;
+    ConcurrentArena &operator=(const ConcurrentArena &) = delete;
+
+    ~ConcurrentArena()
+    {
+        auto c = current.load();
+        while (c)
+        {
+            auto n = std::min(c->used.load(), c->capacity);
+            for (size_t i = 0; i < n; i++)
+            {
+                if (c->constructed[i])
+                    c->data[i].~T();
+            }
+            ::operator delete(c->data, std::align_val_t(alignof(T)));
+            auto prev = c->prev;
+            delete c;
+            c = prev;
+        }
+    }
+
+    template <class ... Args>
+    T *create(Args && ... args)
+    {
+        auto c = current.load();
+        while (1)
+        {
+            if (c)
+            {
+                auto i = c->used.fetch_add(1);
+                if (i < c->capacity)
+                {
+                    // slot is lost if constructor throws
+                    auto v = new (&c->data[i]) T(std::forward<Args>(args)...);
+                    c->constructed[i] = true;
+                    return v;
+                }
+            }
+            c = grow(c);
+        }
+    }
+
+    ConcurrentArenaStats getStats() const
+    {
+        ConcurrentArenaStats s;
+        for (auto c = current.load(); c; c = c->prev)
+        {
+            s.values += std::min(c->used.load(), c->capacity);
+            s.chunks++;
+            s.bytes += c->capacity * sizeof(T);
+        }
+        return s;
+    }
+
+private:
+    struct Chunk
+    {
+        std::atomic<size_t> used{ 0 };
+        size_t capacity;
+        T *data;
+        std::unique_ptr<bool[]> constructed;
+        Chunk *prev;
+    };
+
+    // chunks double up to 64k values
+    static constexpr size_t min_chunk = 256;
+    static constexpr size_t max_chunk = 65536;
+
+    std::atomic<Chunk *> current{ nullptr };
+    std::mutex m;
+
+    Chunk *grow(Chunk *full)
+    {
+        std::unique_lock lk(m);
+        auto c = current.load();
+        if (c != full)
+            return c; // someone else did it
+        auto n = new Chunk;
+        n->capacity = c ? std::min(c->capacity * 2, max_chunk) : min_chunk;
+        n->data = (T *)::operator new(n->capacity * sizeof(T), std::align_val_t(alignof(T)));
+        n->constructed = std::make_unique<bool[]>(n->capacity);
+        n->prev = c;
+        current = n;
+        return n;
+    }
+};
 
 template <class K, class V>
 struct ConcurrentMap
@@ -20,11 +123,15 @@ struct ConcurrentMap
     ConcurrentMap()
     {
         m = std::make_unique<MapType>();
+        values = std::make_unique<ConcurrentArena<V>>();
     }
 
+    /// not thread safe, the map itself is replaced too
     void clear()
     {
         m = std::make_unique<MapType>();
+        // nobody else holds values now, release them at once
+        values = std::make_unique<ConcurrentArena<V>>();
     }
 
     insert_type insert(const value_type &v)
@@ -41,10 +148,11 @@ struct ConcurrentMap
         auto value = i.getValue();
         if (!value)
         {
-            value = new V(v);
+            value = values->create(v);
             auto oldValue = i.exchangeValue(value);
             if (oldValue)
             {
+                // old value stays in arena, it may be used by the other thread
                 *value = *oldValue;
                 std::forward<Deleter>(d)(oldValue);
                 return { value, false };
@@ -83,13 +191,26 @@ struct ConcurrentMap
         return *insert(k).first;
     }
 
+    V *find(K k) const
+    {
+        if (k == 0)
+            return nullptr;
+        return m->get(k);
+    }
+
     auto getIterator()
     {
         return typename MapType::Iterator(*m);
     }
 
+    ConcurrentArenaStats getArenaStats() const
+    {
+        return values->getStats();
+    }
+
 private:
     std::unique_ptr<MapType> m;
+    std::unique_ptr<ConcurrentArena<V>> values;
 };
 
 template <class V>
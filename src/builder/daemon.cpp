@@ -0,0 +1,375 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "daemon.h"
+
+#include <hash.h>
+
+#include <primitives/sw/settings.h>
+
+#include <boost/asio.hpp>
+#include <boost/dll.hpp>
+
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "daemon");
+
+#define DAEMON_MAX_MESSAGE_SIZE (1ULL << 30)
+
+static cl::opt<int> daemon_idle("daemon-idle", cl::desc("Stop build daemon after this many minutes without requests"), cl::init(30));
+
+namespace sw
+{
+
+path getDaemonSocket(const path &workspace)
+{
+    // socket paths are limited to ~100 chars, so keep it short
+    auto ws = normalize_path(fs::absolute(workspace));
+#ifndef _WIN32
+    ws += ":" + std::to_string(getuid());
+#endif
+    return fs::temp_directory_path() / ("sw_" + sha256_short(ws) + ".sock");
+}
+
+#ifdef _WIN32
+
+void runDaemon(const path &workspace, const DaemonHandler &h)
+{
+    throw std::runtime_error("Build daemon is not supported on this platform");
+}
+
+std::optional<int> runOnDaemon(const path &workspace, const Strings &args)
+{
+    return {};
+}
+
+#else
+
+using boost::asio::local::stream_protocol;
+
+namespace
+{
+
+enum class MessageType : uint8_t
+{
+    Request = 1,
+    Output,
+    Exit,
+};
+
+struct Writer
+{
+    String s;
+
+    void write(uint64_t v) { s.append((const char *)&v, sizeof(v)); }
+    void write(const String &v)
+    {
+        write((uint64_t)v.size());
+        s += v;
+    }
+};
+
+struct Reader
+{
+    const String &s;
+    size_t pos = 0;
+
+    Reader(const String &s) : s(s) {}
+
+    uint64_t u64()
+    {
+        uint64_t v;
+        check(sizeof(v));
+        memcpy(&v, s.data() + pos, sizeof(v));
+        pos += sizeof(v);
+        return v;
+    }
+
+    String str()
+    {
+        auto n = u64();
+        check(n);
+        auto v = s.substr(pos, n);
+        pos += n;
+        return v;
+    }
+
+private:
+    void check(size_t n) const
+    {
+        if (pos + n > s.size())
+            throw std::runtime_error("Bad daemon message");
+    }
+};
+
+}
+
+static void send(stream_protocol::socket &s, MessageType t, const String &payload)
+{
+    char h[9];
+    h[0] = (char)t;
+    uint64_t sz = payload.size();
+    memcpy(h + 1, &sz, sizeof(sz));
+    std::array<boost::asio::const_buffer, 2> bufs{ boost::asio::buffer(h), boost::asio::buffer(payload) };
+    boost::asio::write(s, bufs);
+}
+
+static MessageType receive(stream_protocol::socket &s, String &payload)
+{
+    char h[9];
+    boost::asio::read(s, boost::asio::buffer(h));
+    uint64_t sz;
+    memcpy(&sz, h + 1, sizeof(sz));
+    if (sz > DAEMON_MAX_MESSAGE_SIZE)
+        throw std::runtime_error("Too big daemon message");
+    payload.resize(sz);
+    boost::asio::read(s, boost::asio::buffer(payload));
+    return (MessageType)h[0];
+}
+
+// socket name is predictable, so the other side must be us
+static bool isOurUser(stream_protocol::socket &s)
+{
+    uid_t uid;
+#ifdef SO_PEERCRED
+    ucred c;
+    socklen_t len = sizeof(c);
+    if (getsockopt(s.native_handle(), SOL_SOCKET, SO_PEERCRED, &c, &len) == -1)
+        return false;
+    uid = c.uid;
+#else
+    gid_t gid;
+    if (getpeereid(s.native_handle(), &uid, &gid) == -1)
+        return false;
+#endif
+    return uid == getuid();
+}
+
+static void flushOutput()
+{
+    LOG_FLUSH();
+    std::cout.flush();
+    std::cerr.flush();
+    std::clog.flush();
+    fflush(stdout);
+    fflush(stderr);
+}
+
+static void serve(stream_protocol::socket &s, const DaemonHandler &h)
+{
+    String payload;
+    if (receive(s, payload) != MessageType::Request)
+        throw std::runtime_error("Request expected");
+    Reader r(payload);
+    auto cwd = fs::u8path(r.str());
+    Strings args(r.u64());
+    for (auto &a : args)
+        a = r.str();
+
+    // stdout and stderr of the request go to the client
+    int p[2];
+    if (pipe(p) == -1)
+        throw std::runtime_error("Cannot create pipe: "s + strerror(errno));
+    flushOutput();
+    int saved_out = dup(1);
+    int saved_err = dup(2);
+    dup2(p[1], 1);
+    dup2(p[1], 2);
+    close(p[1]);
+
+    std::thread t([&s, fd = p[0]]
+    {
+        bool connected = true;
+        char buf[8192];
+        while (1)
+        {
+            auto n = read(fd, buf, sizeof(buf));
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            if (!connected)
+                continue;
+            try
+            {
+                send(s, MessageType::Output, String(buf, n));
+            }
+            catch (std::exception &)
+            {
+                // client is gone, finish the request anyway
+                connected = false;
+            }
+        }
+    });
+
+    int code = 1;
+    try
+    {
+        fs::current_path(cwd);
+        code = h(args);
+    }
+    catch (std::exception &e)
+    {
+        LOG_ERROR(logger, e.what());
+    }
+    catch (...)
+    {
+    }
+
+    flushOutput();
+    dup2(saved_out, 1);
+    dup2(saved_err, 2);
+    close(saved_out);
+    close(saved_err);
+    t.join();
+    close(p[0]);
+
+    Writer w;
+    w.write((uint64_t)code);
+    send(s, MessageType::Exit, w.s);
+}
+
+void runDaemon(const path &workspace, const DaemonHandler &h)
+{
+    auto fn = getDaemonSocket(workspace);
+    error_code ec;
+    fs::remove(fn, ec);
+
+    boost::asio::io_context ctx;
+    // requests run arbitrary builds, so only we may connect
+    auto old_mask = umask(S_IRWXG | S_IRWXO);
+    stream_protocol::acceptor a(ctx, stream_protocol::endpoint(fn.string()));
+    umask(old_mask);
+    LOG_INFO(logger, "Build daemon is listening on " << fn.string());
+
+    while (1)
+    {
+        pollfd pfd{};
+        pfd.fd = a.native_handle();
+        pfd.events = POLLIN;
+        auto r = poll(&pfd, 1, daemon_idle * 60 * 1000);
+        if (r == 0)
+            break;
+        if (r == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("poll failed: "s + strerror(errno));
+        }
+
+        stream_protocol::socket s(ctx);
+        a.accept(s);
+        if (!isOurUser(s))
+        {
+            LOG_WARN(logger, "Connection from another user is refused");
+            continue;
+        }
+        try
+        {
+            serve(s, h);
+        }
+        catch (std::exception &e)
+        {
+            LOG_WARN(logger, "daemon request failed: " << e.what());
+        }
+    }
+
+    LOG_INFO(logger, "No requests for " << daemon_idle << " minutes, stopping build daemon");
+    fs::remove(fn, ec);
+}
+
+static void startDaemon(const path &workspace)
+{
+    // prepare everything before fork, child may only call async-signal-safe functions
+    auto prog = boost::dll::program_location().string();
+    auto wdir = workspace.string();
+
+    auto pid = fork();
+    if (pid != 0)
+        return;
+
+    // detach from our session and terminal
+    setsid();
+    int fd = open("/dev/null", O_RDWR);
+    if (fd != -1)
+    {
+        dup2(fd, 0);
+        dup2(fd, 1);
+        dup2(fd, 2);
+    }
+    if (chdir(wdir.c_str()) == 0)
+        execl(prog.c_str(), prog.c_str(), "daemon", (char *)nullptr);
+    _exit(1);
+}
+
+std::optional<int> runOnDaemon(const path &workspace, const Strings &args)
+{
+    auto fn = getDaemonSocket(workspace);
+
+    boost::asio::io_context ctx;
+    stream_protocol::socket s(ctx);
+    boost::system::error_code ec;
+    s.connect(stream_protocol::endpoint(fn.string()), ec);
+    if (ec)
+    {
+        LOG_DEBUG(logger, "Starting build daemon");
+        startDaemon(workspace);
+        for (int i = 0; i < 100 && ec; i++)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            s.close();
+            s.connect(stream_protocol::endpoint(fn.string()), ec);
+        }
+        if (ec)
+        {
+            LOG_WARN(logger, "Cannot connect to build daemon: " << ec.message());
+            return {};
+        }
+    }
+    if (!isOurUser(s))
+    {
+        LOG_WARN(logger, "Build daemon socket " << fn.string() << " belongs to another user, building locally");
+        return {};
+    }
+
+    Writer w;
+    w.write(fs::current_path().u8string());
+    w.write((uint64_t)args.size());
+    for (auto &a : args)
+        w.write(a);
+    send(s, MessageType::Request, w.s);
+
+    while (1)
+    {
+        String payload;
+        switch (receive(s, payload))
+        {
+        case MessageType::Output:
+            fwrite(payload.data(), payload.size(), 1, stdout);
+            fflush(stdout);
+            break;
+        case MessageType::Exit:
+            return (int)Reader(payload).u64();
+        default:
+            throw std::runtime_error("Bad daemon message");
+        }
+    }
+}
+
+#endif
+
+}
@@ -0,0 +1,39 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+#include <functional>
+#include <optional>
+
+namespace sw
+{
+
+/// build server (sw daemon), one per workspace
+///
+/// Keeps databases, file storages, config modules and plans in memory
+/// between sw invocations. Client sends its cwd and args over a unix socket,
+/// daemon runs them and streams stdout/stderr back with the exit code.
+/// Requests are served one at a time.
+
+/// runs request args in the daemon process, returns exit code
+using DaemonHandler = std::function<int(const Strings &args)>;
+
+SW_BUILDER_API
+path getDaemonSocket(const path &workspace);
+
+/// serves requests until there are none for --daemon-idle minutes
+SW_BUILDER_API
+void runDaemon(const path &workspace, const DaemonHandler &h);
+
+/// sends args to the workspace daemon, starts it when it is not running,
+/// returns nothing when daemon is not available, run locally then
+SW_BUILDER_API
+std::optional<int> runOnDaemon(const path &workspace, const Strings &args);
+
+}
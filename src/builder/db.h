@@ -17,6 +17,8 @@ struct Db
     virtual void load(FileStorage &fs, ConcurrentHashMap<path, FileRecord> &files) const = 0;
     virtual void save(FileStorage &fs, ConcurrentHashMap<path, FileRecord> &files) const = 0;
     virtual void write(std::vector<uint8_t> &v, const FileRecord &r) const {}
+    // records of this process are appended there
+    virtual path getLogFile(const String &config) const = 0;
 
     virtual void load(ConcurrentCommandStorage &commands) const = 0;
     virtual void save(ConcurrentCommandStorage &commands) const = 0;
@@ -6,6 +6,8 @@
 
 #include "db_file.h"
 
+#include "mapped_file.h"
+
 #include <directories.h>
 //#include <target.h>
 
@@ -17,13 +19,19 @@ void save_from_memory_to_file(const path &fn, sqlite3 *db);
 #include <primitives/context.h>
 #include <primitives/date_time.h>
 #include <primitives/debug.h>
+#include <primitives/executor.h>
 #include <primitives/lock.h>
 
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string_view>
+
 #include <primitives/log.h>
 DECLARE_STATIC_LOGGER(logger, "db_file");
 
-#define FILE_DB_FORMAT_VERSION 1
-#define COMMAND_DB_FORMAT_VERSION 1
+#define FILE_DB_FORMAT_VERSION 4
+#define COMMAND_DB_FORMAT_VERSION 2
 
 namespace sw
 {
@@ -33,128 +41,245 @@ static path getDir()
     return getUserDirectories().storage_dir_tmp / "db";
 }
 
-static path getFilesDbFilename(const String &config)
+static path getCommandsDbFilename()
 {
     auto p = getDir();
     p += ".";
-    p += std::to_string(FILE_DB_FORMAT_VERSION);
-    p += "." + config + ".files";
+    p += std::to_string(COMMAND_DB_FORMAT_VERSION);
+    p += ".commands";
     return p;
 }
 
-static path getCommandsDbFilename()
+// files db is a directory of append-only segments, newer records win
+//
+// record: u32 size, u64 path hash, i64 last_write_time, then the rest (see encode())
+// each process appends to its own segment (locked while it lives),
+// closed segments are merged by compaction from time to time
+
+static const size_t max_segments = 16;
+
+static path getFilesDbDir(const String &config)
 {
     auto p = getDir();
     p += ".";
-    p += std::to_string(COMMAND_DB_FORMAT_VERSION);
-    p += ".commands";
+    p += std::to_string(FILE_DB_FORMAT_VERSION);
+    p += "." + config + ".files";
     return p;
 }
 
-static void load(FileStorage &fs, const path &fn, ConcurrentHashMap<path, FileRecord> &files, std::unordered_map<int64_t, std::unordered_set<int64_t>> &deps)
+static path getLockFilename(const path &segment)
 {
-    ScopedShareableFileLock lk(fn);
+    auto p = segment;
+    p += ".lock";
+    return p;
+}
 
-    BinaryContext b;
-    try
-    {
-        b.load(fn);
-    }
-    catch (std::exception &)
+static Files getSegments(const path &dir)
+{
+    Files segments;
+    error_code ec;
+    for (auto &e : fs::directory_iterator(dir, ec))
     {
-        if (fs::exists(fn))
-            throw;
-        return;
+        if (e.path().extension() != ".log")
+            continue;
+        // not ours
+        auto n = e.path().stem().string();
+        if (n.empty() || n.size() > 19 || !std::all_of(n.begin(), n.end(), [](auto c) { return isdigit((unsigned char)c); }))
+            continue;
+        segments.insert(e.path());
     }
-    while (!b.eof())
-    {
-        size_t h;
-        b.read(h);
-
-        String p;
-        b.read(p);
+    return segments;
+}
 
-        auto kv = files.insert(h);
-        kv.first->file = p;
-        kv.first->data = fs.registerFile(p)->data;
+static std::vector<path> getSortedSegments(const path &dir)
+{
+    auto s = getSegments(dir);
+    std::vector<path> v(s.begin(), s.end());
+    // names are zero padded sequence numbers
+    std::sort(v.begin(), v.end());
+    return v;
+}
 
-        decltype(kv.first->data->last_write_time) lwt;
-        b.read(lwt);
+// segments of this process
+static std::mutex segments_m;
+static std::map<path, std::unique_ptr<ScopedFileLock>> own_segments;
+static std::map<String, path> config_segments;
 
-        if (kv.first->data->last_write_time < lwt)
-        {
-            kv.first->data->last_write_time = lwt;
-        }
+static path createSegment(const path &dir)
+{
+    fs::create_directories(dir);
 
-        size_t n;
-        b.read(n);
+    uint64_t seq = 0;
+    for (auto &s : getSegments(dir))
+        seq = std::max<uint64_t>(seq, std::stoull(s.stem().string()) + 1);
 
-        for (int i = 0; i < n; i++)
-        {
-            size_t h2;
-            b.read(h2);
-            deps[h].insert(h2);
-        }
+    std::unique_lock lk(segments_m);
+    while (1)
+    {
+        std::ostringstream ss;
+        ss << std::setw(12) << std::setfill('0') << seq++;
+        auto fn = dir / (ss.str() + ".log");
+        auto l = std::make_unique<ScopedFileLock>(getLockFilename(fn), std::defer_lock);
+        if (!l->try_lock() || fs::exists(fn))
+            continue;
+        own_segments[fn] = std::move(l);
+        return fn;
     }
 }
 
-static void load_log(FileStorage &fs, const path &fn, ConcurrentHashMap<path, FileRecord> &files, std::unordered_map<int64_t, std::unordered_set<int64_t>> &deps)
+namespace
+{
+
+struct SegmentRecord
+{
+    const uint8_t *p = nullptr; // after size
+    uint32_t size = 0;
+    int64_t lwt = 0;
+};
+
+// newest records of mapped segments, nothing is decoded except the keys
+struct SegmentIndex
 {
-    ScopedShareableFileLock lk(fn);
+    std::vector<std::unique_ptr<MappedFile>> maps;
+    std::unordered_map<uint64_t, SegmentRecord> records;
+    size_t total = 0;
 
-    FILE *fp = primitives::filesystem::fopen(fn, "rb");
-    if (!fp)
+    void add(const path &fn)
     {
-        if (fs::exists(fn))
-            throw std::runtime_error("Cannot open file: " + fn.u8string());
-        return;
+        auto m = std::make_unique<MappedFile>(fn);
+        auto p = m->data();
+        const auto e = p + m->size();
+        const size_t header = sizeof(uint64_t) + sizeof(int64_t);
+        while (p + sizeof(uint32_t) <= e)
+        {
+            uint32_t sz;
+            memcpy(&sz, p, sizeof(sz));
+            p += sizeof(sz);
+            // torn tail of a crashed writer
+            if (sz < header || sz > (size_t)(e - p))
+                break;
+
+            uint64_t k;
+            memcpy(&k, p, sizeof(k));
+            int64_t lwt;
+            memcpy(&lwt, p + sizeof(k), sizeof(lwt));
+
+            // same time: later write wins, it may have the hash
+            auto &r = records[k];
+            if (!r.p || r.lwt <= lwt)
+                r = { p, sz, lwt };
+            total++;
+            p += sz;
+        }
+        maps.push_back(std::move(m));
     }
-    while (!feof(fp))
-    {
-        int64_t h;
-        fread(&h, sizeof(h), 1, fp);
+};
 
-        if (feof(fp))
-            break;
+struct RecordReader
+{
+    const uint8_t *p;
+    const uint8_t *e;
 
-        size_t sz;
-        fread(&sz, sizeof(sz), 1, fp);
+    template <class T>
+    T read()
+    {
+        T v;
+        check(sizeof(v));
+        memcpy(&v, p, sizeof(v));
+        p += sizeof(v);
+        return v;
+    }
 
-        String p(sz, 0);
-        fread(&p[0], sz, 1, fp);
+    String str()
+    {
+        auto n = read<size_t>();
+        check(n);
+        String s((const char *)p, n);
+        p += n;
+        return s;
+    }
 
-        auto kv = files.insert(h);
-        kv.first->file = p;
-        kv.first->data = fs.registerFile(p)->data;
+private:
+    void check(size_t n) const
+    {
+        if (n > (size_t)(e - p))
+            throw std::runtime_error("Bad files db record");
+    }
+};
 
-        decltype(kv.first->data->last_write_time) lwt;
-        fread(&lwt, sizeof(kv.first->data->last_write_time), 1, fp);
+}
 
-        /*sz = 0;
-        fread(&sz, sizeof(kv.first->data->size), 1, fp);
+static uint64_t getRecordDigest(const uint8_t *p, size_t n)
+{
+    return std::hash<std::string_view>()(std::string_view((const char *)p, n));
+}
 
-        uint64_t flags;
-        fread(&flags, sizeof(flags), 1, fp);*/
+static void compact(const String &config)
+{
+    const auto dir = getFilesDbDir(config);
+    ScopedFileLock cl(dir / "compact.lock", std::defer_lock);
+    if (!cl.try_lock())
+        return;
 
-        if (kv.first->data->last_write_time < lwt)
+    // only closed segments, writers keep theirs locked
+    std::vector<std::pair<path, std::unique_ptr<ScopedFileLock>>> segments;
+    for (auto &fn : getSortedSegments(dir))
+    {
         {
-            kv.first->data->last_write_time = lwt;
-            //kv.first->data->size = sz;
-            //kv.first->data->flags = flags;
+            std::unique_lock lk(segments_m);
+            if (own_segments.find(fn) != own_segments.end())
+                continue;
         }
+        auto l = std::make_unique<ScopedFileLock>(getLockFilename(fn), std::defer_lock);
+        if (l->try_lock())
+            segments.emplace_back(fn, std::move(l));
+    }
+    if (segments.size() < 2)
+        return;
 
-        size_t n;
-        fread(&n, sizeof(n), 1, fp);
+    const auto &last = segments.back().first;
+    auto tmp = last;
+    tmp += ".tmp";
+    try
+    {
+        {
+            SegmentIndex idx;
+            for (auto &[fn, _] : segments)
+                idx.add(fn);
+
+            ScopedFile f(tmp, "wb");
+            for (auto &[k, r] : idx.records)
+            {
+                fwrite(&r.size, sizeof(r.size), 1, f.getHandle());
+                fwrite(r.p, r.size, 1, f.getHandle());
+            }
+        }
 
-        for (size_t i = 0; i < n; i++)
+        // readers see old or merged segment, records are never lost
+        fs::rename(tmp, last);
+        for (auto &[fn, l] : segments)
         {
-            int64_t h2;
-            fread(&h2, sizeof(h2), 1, fp);
+            if (fn != last)
+                fs::remove(fn);
+        }
+    }
+    catch (std::exception &e)
+    {
+        LOG_DEBUG(logger, "files db compaction failed: " << e.what());
+        error_code ec;
+        fs::remove(tmp, ec);
+        return;
+    }
 
-            deps[h].insert(h2);
+    for (auto &[fn, l] : segments)
+    {
+        l.reset();
+        if (fn != last)
+        {
+            error_code ec;
+            fs::remove(getLockFilename(fn), ec);
         }
     }
-    fclose(fp);
 }
 
 Db &getDb()
@@ -165,12 +290,72 @@ Db &getDb()
 
 void FileDb::load(FileStorage &fs, ConcurrentHashMap<path, FileRecord> &files) const
 {
-    std::unordered_map<int64_t, std::unordered_set<int64_t>> deps;
+    const auto dir = getFilesDbDir(fs.config);
+    auto segments = getSortedSegments(dir);
+
+    // compaction in another process may remove listed segments,
+    // it writes the merged records into the last one of them first,
+    // so they are still seen here: segments are mapped in ascending order
+    SegmentIndex idx;
+    for (auto &fn : segments)
+    {
+        try
+        {
+            idx.add(fn);
+        }
+        catch (std::exception &e)
+        {
+            error_code ec;
+            if (fs::exists(fn, ec))
+                LOG_DEBUG(logger, "Cannot read files db segment " << fn.u8string() << ": " << e.what());
+        }
+    }
 
-    sw::load(fs, getFilesDbFilename(fs.config), files, deps);
-    sw::load_log(fs, getFilesLogFileName(fs.config), files, deps);
-    error_code ec;
-    fs::remove(getFilesLogFileName(fs.config), ec);
+    std::unordered_map<int64_t, std::vector<int64_t>> deps;
+    for (auto &[h, rec] : idx.records)
+    {
+        String p, hash;
+        fs::file_time_type lwt, ht, ct;
+        int64_t sz = 0;
+        std::vector<int64_t> d;
+        try
+        {
+            RecordReader r{ rec.p, rec.p + rec.size };
+            r.read<uint64_t>();
+            lwt = fs::file_time_type{ fs::file_time_type::duration{ r.read<int64_t>() } };
+            p = r.str();
+            hash = r.str();
+            ht = fs::file_time_type{ fs::file_time_type::duration{ r.read<int64_t>() } };
+            sz = r.read<int64_t>();
+            ct = fs::file_time_type{ fs::file_time_type::duration{ r.read<int64_t>() } };
+            auto n = r.read<size_t>();
+            if (n > rec.size / sizeof(int64_t))
+                throw std::runtime_error("Bad files db record");
+            for (size_t i = 0; i < n; i++)
+                d.push_back(r.read<int64_t>());
+        }
+        catch (std::exception &)
+        {
+            // corrupt record, the file is checked again
+            continue;
+        }
+
+        auto kv = files.insert(h);
+        kv.first->file = p;
+        kv.first->data = fs.registerFile(p)->data;
+        kv.first->saved_digest = getRecordDigest(rec.p, rec.size);
+
+        if (kv.first->data->last_write_time <= lwt)
+        {
+            kv.first->data->last_write_time = lwt;
+            kv.first->data->hash = hash;
+            kv.first->data->hash_time = ht;
+            kv.first->data->size = sz;
+            kv.first->data->content_time = ct;
+        }
+
+        deps[h] = std::move(d);
+    }
 
     for (auto &[k, v] : deps)
     {
@@ -180,48 +365,48 @@ void FileDb::load(FileStorage &fs, ConcurrentHashMap<path, FileRecord> &files) c
                 continue;
             auto k2 = &files[h2];
             if (k2 && !k2->file.empty())
-                files[k].implicit_dependencies.insert({ k2->file, k2 });
+                files[k].implicit_dependencies.insert({ internPath(k2->file), k2 });
         }
     }
-}
-
-void FileDb::save(FileStorage &fs, ConcurrentHashMap<path, FileRecord> &files) const
-{
-    const auto f = getFilesDbFilename(fs.config);
 
-    // first, we load current copy of files
-    ConcurrentHashMap<path, FileRecord> old;
-    load(fs, old);
-
-    // compare and renew our (actually any) copy
-    for (auto i = old.getIterator(); i.isValid(); i.next())
+    // garbage is more than live records
+    if (segments.size() > max_segments || idx.total > idx.records.size() * 2)
     {
-        auto &f = *i.getValue();
-        if (f.file.empty())
-            continue;
-        auto[ptr, inserted] = files.insert(f.file, f);
-        if (!inserted && f.data && *ptr < f)
-            *ptr = f;
+        getExecutor().push([config = fs.config]
+        {
+            compact(config);
+        });
     }
+}
 
-    BinaryContext b(10'000'000); // reserve amount
+void FileDb::save(FileStorage &fs, ConcurrentHashMap<path, FileRecord> &files) const
+{
+    // only records changed since they were loaded or logged
+    std::vector<uint8_t> b, v;
     for (auto i = files.getIterator(); i.isValid(); i.next())
     {
         auto &f = *i.getValue();
-        if (!f.data)
+        if (!f.data || f.file.empty())
             continue;
+        auto old = f.saved_digest.load();
+        write(v, f);
+        if (f.saved_digest == old)
+            continue;
+        b.insert(b.end(), v.begin(), v.end());
+    }
+    fs.writeLog(b);
+}
 
-        auto h1 = std::hash<path>()(f.file);
-        b.write(h1);
-        b.write(normalize_path(f.file));
-        b.write(f.data->last_write_time.time_since_epoch().count());
-        //b.write(f.data->size);
-        b.write(f.implicit_dependencies.size());
-
-        for (auto &[f, d] : f.implicit_dependencies)
-            b.write(std::hash<path>()(d->file));
+path FileDb::getLogFile(const String &config) const
+{
+    {
+        std::unique_lock lk(segments_m);
+        if (auto i = config_segments.find(config); i != config_segments.end())
+            return i->second;
     }
-    b.save(f);
+    auto fn = createSegment(getFilesDbDir(config));
+    std::unique_lock lk(segments_m);
+    return config_segments.emplace(config, fn).first->second;
 }
 
 template <class T>
@@ -245,17 +430,25 @@ void FileDb::write(std::vector<uint8_t> &v, const FileRecord &f) const
 {
     v.clear();
 
-    write_int(v, std::hash<path>()(f.file));
+    write_int(v, (uint32_t)0);
+    write_int(v, (uint64_t)std::hash<path>()(f.file));
+    write_int(v, (int64_t)f.data->last_write_time.time_since_epoch().count());
     write_str(v, normalize_path(f.file));
-    write_int(v, f.data->last_write_time);
-    //write_int(v, f.data->size);
+    write_str(v, f.data->hash);
+    write_int(v, (int64_t)f.data->hash_time.time_since_epoch().count());
+    write_int(v, f.data->size);
+    write_int(v, (int64_t)f.data->content_time.time_since_epoch().count());
     //write_int(v, f.data->flags.to_ullong());
 
     auto n = f.implicit_dependencies.size();
     write_int(v, n);
 
     for (auto &[f, d] : f.implicit_dependencies)
-        write_int(v, std::hash<path>()(d->file));
+        write_int(v, (int64_t)std::hash<path>()(d->file));
+
+    uint32_t sz = (uint32_t)(v.size() - sizeof(sz));
+    memcpy(&v[0], &sz, sizeof(sz));
+    f.saved_digest = getRecordDigest(&v[sizeof(sz)], sz);
 }
 
 void FileDb::load(ConcurrentCommandStorage &commands) const
@@ -276,9 +469,13 @@ void FileDb::load(ConcurrentCommandStorage &commands) const
     {
         size_t k;
         b.read(k);
-        size_t h;
-        b.read(h);
-        commands.insert_ptr(k, h);
+        CommandRecord r;
+        b.read(r.hash);
+        b.read(r.wall_time);
+        b.read(r.cpu_time);
+        b.read(r.peak_rss);
+        b.read(r.exit_code);
+        commands.insert_ptr(k, r);
     }
 }
 
@@ -287,8 +484,13 @@ void FileDb::save(ConcurrentCommandStorage &commands) const
     BinaryContext b(10'000'000); // reserve amount
     for (auto i = commands.getIterator(); i.isValid(); i.next())
     {
+        auto &r = *i.getValue();
         b.write(i.getKey());
-        b.write(*i.getValue());
+        b.write(r.hash);
+        b.write(r.wall_time);
+        b.write(r.cpu_time);
+        b.write(r.peak_rss);
+        b.write(r.exit_code);
     }
     b.save(getCommandsDbFilename());
 }
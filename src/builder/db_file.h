@@ -16,6 +16,7 @@ struct FileDb : Db
     void load(FileStorage &fs, ConcurrentHashMap<path, FileRecord> &files) const override;
     void save(FileStorage &fs, ConcurrentHashMap<path, FileRecord> &files) const override;
     void write(std::vector<uint8_t> &v, const FileRecord &r) const override;
+    path getLogFile(const String &config) const override;
 
     void load(ConcurrentCommandStorage &commands) const override;
     void save(ConcurrentCommandStorage &commands) const override;
@@ -0,0 +1,132 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "depfile.h"
+
+namespace sw
+{
+
+static bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool isSpecial(char c)
+{
+    switch (c)
+    {
+    case ' ':
+    case '\t':
+    case '\r':
+    case '\n':
+    case '\\':
+    case '$':
+    case ':':
+        return true;
+    }
+    return false;
+}
+
+// backslash-newline, returns its length
+static size_t continuation(std::string_view s, size_t i)
+{
+    if (s[i] != '\\' || i + 1 >= s.size())
+        return 0;
+    if (s[i + 1] == '\n')
+        return 2;
+    if (s[i + 1] == '\r' && i + 2 < s.size() && s[i + 2] == '\n')
+        return 3;
+    return 0;
+}
+
+void parseDepfile(std::string_view s, String &buf, std::vector<std::string_view> &deps)
+{
+    buf.clear();
+    deps.clear();
+    // unescaped text is never longer, so views stay valid
+    buf.reserve(s.size());
+
+    bool targets = true;
+    size_t i = 0;
+    const auto n = s.size();
+    while (i < n)
+    {
+        auto c = s[i];
+        if (isSpace(c))
+        {
+            i++;
+            continue;
+        }
+        if (c == '\n')
+        {
+            // next rule
+            targets = true;
+            i++;
+            continue;
+        }
+        if (auto l = continuation(s, i))
+        {
+            i += l;
+            continue;
+        }
+        if (c == '#')
+        {
+            while (i < n && s[i] != '\n')
+                i++;
+            continue;
+        }
+
+        // token
+        auto start = buf.size();
+        bool colon = false;
+        while (i < n)
+        {
+            // plain characters are copied at once
+            auto j = i;
+            while (j < n && !isSpecial(s[j]))
+                j++;
+            buf.append(s.data() + i, j - i);
+            i = j;
+            if (i == n)
+                break;
+
+            c = s[i];
+            if (isSpace(c) || c == '\n' || continuation(s, i))
+                break;
+            if (c == '\\' && i + 1 < n && (s[i + 1] == ' ' || s[i + 1] == '#'))
+            {
+                buf += s[i + 1];
+                i += 2;
+                continue;
+            }
+            if (c == '$' && i + 1 < n && s[i + 1] == '$')
+            {
+                buf += '$';
+                i += 2;
+                continue;
+            }
+            // not a drive letter, "c:\file"
+            if (c == ':' && targets && (i + 1 == n || isSpace(s[i + 1]) || s[i + 1] == '\n' || continuation(s, i + 1)))
+            {
+                colon = true;
+                i++;
+                break;
+            }
+            // other backslashes are kept, windows paths
+            buf += c;
+            i++;
+        }
+
+        if (!targets && buf.size() > start)
+            deps.emplace_back(buf.data() + start, buf.size() - start);
+        else
+            buf.resize(start);
+        if (colon)
+            targets = false;
+    }
+}
+
+}
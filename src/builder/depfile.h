@@ -0,0 +1,26 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <primitives/string.h>
+
+#include <string_view>
+#include <vector>
+
+namespace sw
+{
+
+/// single pass parser of Makefile depfiles (gcc/clang -MD output)
+///
+/// Handles line continuations, escaped spaces and '#', '$$',
+/// several rules and phony targets (-MP). Targets are skipped.
+/// deps point into buf, pass the same buf and deps for many files
+/// and nothing is allocated after the first ones.
+SW_BUILDER_API
+void parseDepfile(std::string_view s, String &buf, std::vector<std::string_view> &deps);
+
+}
@@ -0,0 +1,697 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "distributed.h"
+
+#include "command_cache.h"
+#include "file.h"
+
+#include <primitives/executor.h>
+#include <primitives/sw/settings.h>
+#include <primitives/templates.h>
+
+#include <boost/asio.hpp>
+
+#include <cstring>
+#include <map>
+#include <set>
+#include <thread>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "distributed");
+
+#define DISTRIBUTED_PROTOCOL_VERSION 2
+#define DISTRIBUTED_MAX_MESSAGE_SIZE (1ULL << 32)
+
+static cl::list<String> workers("workers", cl::desc("Remote workers to execute commands on (host:port)"), cl::CommaSeparated);
+
+using boost::asio::ip::tcp;
+
+namespace sw
+{
+
+namespace
+{
+
+enum class MessageType : uint8_t
+{
+    Hello = 1,
+    Job,
+    NeedInputs,
+    Inputs,
+    Result,
+    Reject,
+};
+
+struct Writer
+{
+    String s;
+
+    void write(uint64_t v) { s.append((const char *)&v, sizeof(v)); }
+    void write(const String &v)
+    {
+        write((uint64_t)v.size());
+        s += v;
+    }
+    void write(const path &v) { write(v.u8string()); }
+};
+
+struct Reader
+{
+    const String &s;
+    size_t pos = 0;
+
+    Reader(const String &s) : s(s) {}
+
+    uint64_t u64()
+    {
+        uint64_t v;
+        check(sizeof(v));
+        memcpy(&v, s.data() + pos, sizeof(v));
+        pos += sizeof(v);
+        return v;
+    }
+
+    String str()
+    {
+        auto n = u64();
+        check(n);
+        auto v = s.substr(pos, n);
+        pos += n;
+        return v;
+    }
+
+    path p() { return fs::u8path(str()); }
+
+private:
+    void check(uint64_t n) const
+    {
+        if (s.size() - pos < n)
+            throw std::runtime_error("Bad distributed message");
+    }
+};
+
+struct Job
+{
+    path program;
+    String program_hash;
+    Strings args;
+    path working_directory;
+    std::map<String, String> environment;
+    path in;
+    path out;
+    path err;
+    std::vector<std::pair<path, String>> inputs; // path, content hash
+    std::vector<path> outputs;
+
+    String save() const
+    {
+        Writer w;
+        w.write(program);
+        w.write(program_hash);
+        w.write(args.size());
+        for (auto &a : args)
+            w.write(a);
+        w.write(working_directory);
+        w.write(environment.size());
+        for (auto &[k, v] : environment)
+        {
+            w.write(k);
+            w.write(v);
+        }
+        w.write(in);
+        w.write(out);
+        w.write(err);
+        w.write(inputs.size());
+        for (auto &[p, h] : inputs)
+        {
+            w.write(p);
+            w.write(h);
+        }
+        w.write(outputs.size());
+        for (auto &o : outputs)
+            w.write(o);
+        return w.s;
+    }
+
+    void load(const String &s)
+    {
+        Reader r(s);
+        program = r.p();
+        program_hash = r.str();
+        for (auto n = r.u64(); n--;)
+            args.push_back(r.str());
+        working_directory = r.p();
+        for (auto n = r.u64(); n--;)
+        {
+            auto k = r.str();
+            environment[k] = r.str();
+        }
+        in = r.p();
+        out = r.p();
+        err = r.p();
+        for (auto n = r.u64(); n--;)
+        {
+            auto p = r.p();
+            inputs.emplace_back(p, r.str());
+        }
+        for (auto n = r.u64(); n--;)
+            outputs.push_back(r.p());
+    }
+};
+
+struct Result
+{
+    // in the order of Job::outputs, the worker never names files itself
+    struct Output
+    {
+        bool exists = false;
+        String data;
+    };
+
+    int64_t exit_code = 0;
+    String out;
+    String err;
+    std::vector<Output> outputs;
+
+    String save() const
+    {
+        Writer w;
+        w.write((uint64_t)exit_code);
+        w.write(out);
+        w.write(err);
+        w.write(outputs.size());
+        for (auto &o : outputs)
+        {
+            w.write((uint64_t)o.exists);
+            w.write(o.data);
+        }
+        return w.s;
+    }
+
+    void load(const String &s)
+    {
+        Reader r(s);
+        exit_code = (int64_t)r.u64();
+        out = r.str();
+        err = r.str();
+        for (auto n = r.u64(); n--;)
+        {
+            Output o;
+            o.exists = r.u64();
+            o.data = r.str();
+            outputs.push_back(std::move(o));
+        }
+    }
+};
+
+}
+
+static void send(tcp::socket &s, MessageType t, const String &payload)
+{
+    char h[9];
+    h[0] = (char)t;
+    uint64_t sz = payload.size();
+    memcpy(h + 1, &sz, sizeof(sz));
+    std::array<boost::asio::const_buffer, 2> bufs{ boost::asio::buffer(h), boost::asio::buffer(payload) };
+    boost::asio::write(s, bufs);
+}
+
+static MessageType receive(tcp::socket &s, String &payload)
+{
+    char h[9];
+    boost::asio::read(s, boost::asio::buffer(h));
+    uint64_t sz;
+    memcpy(&sz, h + 1, sizeof(sz));
+    if (sz > DISTRIBUTED_MAX_MESSAGE_SIZE)
+        throw std::runtime_error("Too big distributed message");
+    payload.resize(sz);
+    boost::asio::read(s, boost::asio::buffer(payload));
+    return (MessageType)h[0];
+}
+
+static std::pair<String, String> splitAddress(const String &a)
+{
+    auto p = a.rfind(':');
+    if (p == a.npos)
+        throw std::runtime_error("Bad address, host:port expected: " + a);
+    return { a.substr(0, p), a.substr(p + 1) };
+}
+
+static void writeFileAtomically(const path &p, const String &data)
+{
+    fs::create_directories(p.parent_path());
+    auto tmp = p.parent_path() / ("tmp." + unique_path().u8string());
+    write_file(tmp, data);
+    fs::rename(tmp, p);
+}
+
+struct Dispatcher::Worker
+{
+    String host;
+    String port;
+    std::atomic_size_t jobs{ 0 };
+    std::atomic_size_t busy{ 0 };
+    std::atomic_bool failed{ false };
+    boost::asio::io_context ctx;
+    std::mutex m;
+    std::vector<std::unique_ptr<tcp::socket>> idle;
+
+    String getName() const { return host + ":" + port; }
+
+    std::unique_ptr<tcp::socket> connect()
+    {
+        tcp::resolver r(ctx);
+        auto s = std::make_unique<tcp::socket>(ctx);
+        boost::asio::connect(*s, r.resolve(host, port));
+        s->set_option(tcp::no_delay(true));
+
+        String payload;
+        if (receive(*s, payload) != MessageType::Hello)
+            throw std::runtime_error("Hello expected");
+        Reader rd(payload);
+        if (rd.u64() != DISTRIBUTED_PROTOCOL_VERSION)
+            throw std::runtime_error("Protocol version mismatch");
+        jobs = rd.u64();
+        return s;
+    }
+
+    std::unique_ptr<tcp::socket> acquire()
+    {
+        {
+            std::unique_lock<std::mutex> lk(m);
+            if (!idle.empty())
+            {
+                auto s = std::move(idle.back());
+                idle.pop_back();
+                return s;
+            }
+        }
+        return connect();
+    }
+
+    void release(std::unique_ptr<tcp::socket> s)
+    {
+        std::unique_lock<std::mutex> lk(m);
+        idle.push_back(std::move(s));
+    }
+};
+
+Dispatcher::Dispatcher(const Strings &addresses, int local_jobs)
+{
+    local.setLimit(local_jobs);
+    for (auto &a : addresses)
+    {
+        auto w = std::make_unique<Worker>();
+        std::tie(w->host, w->port) = splitAddress(a);
+        try
+        {
+            w->release(w->connect());
+            LOG_INFO(logger, "Worker " + w->getName() + ": " + std::to_string(w->jobs.load()) + " jobs");
+        }
+        catch (std::exception &e)
+        {
+            LOG_WARN(logger, "Cannot connect to worker " + w->getName() + ": " << e.what());
+            w->failed = true;
+        }
+        workers.push_back(std::move(w));
+    }
+}
+
+Dispatcher::~Dispatcher()
+{
+}
+
+size_t Dispatcher::getJobs() const
+{
+    size_t n = 0;
+    for (auto &w : workers)
+    {
+        if (!w->failed)
+            n += w->jobs;
+    }
+    return n;
+}
+
+bool Dispatcher::execute(builder::Command &c, const path &rsp_file)
+{
+    if (workers.empty())
+        return false;
+
+    // take the first worker with a free slot
+    Worker *w = nullptr;
+    for (size_t i = 0, n = next++; i < workers.size(); i++)
+    {
+        auto &w2 = *workers[(n + i) % workers.size()];
+        if (w2.failed)
+            continue;
+        if (w2.busy++ < w2.jobs)
+        {
+            w = &w2;
+            break;
+        }
+        w2.busy--;
+    }
+    if (!w)
+        return false;
+    SCOPE_EXIT
+    {
+        w->busy--;
+    };
+
+    Job j;
+    j.program = c.program;
+    j.program_hash = getContentHash(c.program);
+    j.args = c.args;
+    j.working_directory = c.working_directory;
+    j.environment.insert(c.environment.begin(), c.environment.end());
+    j.in = c.in.file;
+    j.out = c.out.file;
+    j.err = c.err.file;
+
+    // headers are known from previous runs only,
+    // worker rejects the job if its copies differ
+    std::set<path> inputs(c.inputs.begin(), c.inputs.end());
+    for (auto &o : c.outputs)
+    {
+        for (auto &[id, d] : File(o, *c.fs).getFileRecord().implicit_dependencies)
+            inputs.insert(getInternedPath(id));
+    }
+    if (!rsp_file.empty())
+        inputs.insert(rsp_file);
+    for (auto &i : inputs)
+        j.inputs.emplace_back(i, getContentHash(i));
+
+    j.outputs.assign(c.outputs.begin(), c.outputs.end());
+    for (auto &o : c.getSideOutputs())
+    {
+        if (!o.empty())
+            j.outputs.push_back(o);
+    }
+
+    Result r;
+    try
+    {
+        auto s = w->acquire();
+        send(*s, MessageType::Job, j.save());
+
+        String payload;
+        auto t = receive(*s, payload);
+        if (t == MessageType::NeedInputs)
+        {
+            Reader rd(payload);
+            Writer wr;
+            auto n = rd.u64();
+            wr.write(n);
+            while (n--)
+            {
+                auto i = rd.u64();
+                if (i >= j.inputs.size())
+                    throw std::runtime_error("Bad input index");
+                wr.write(i);
+                wr.write(read_file(j.inputs[i].first));
+            }
+            send(*s, MessageType::Inputs, wr.s);
+            t = receive(*s, payload);
+        }
+
+        if (t == MessageType::Reject)
+        {
+            LOG_DEBUG(logger, "Worker " + w->getName() + " rejected " + c.getName() + ": " + payload);
+            w->release(std::move(s));
+            return false;
+        }
+        if (t != MessageType::Result)
+            throw std::runtime_error("Result expected");
+        r.load(payload);
+        w->release(std::move(s));
+    }
+    catch (std::exception &e)
+    {
+        // its commands go local from now on
+        if (!w->failed.exchange(true))
+            LOG_WARN(logger, "Worker " + w->getName() + " is disabled: " << e.what());
+        return false;
+    }
+
+    // worker may miss headers we do not know yet (first build) or it lacks the checkout,
+    // so failures are decided by the local run
+    if (r.exit_code)
+    {
+        LOG_DEBUG(logger, "Command " + c.getName() + " failed on worker " + w->getName() +
+            " with exit code " + std::to_string(r.exit_code) + ", running locally");
+        return false;
+    }
+    if (r.outputs.size() != j.outputs.size())
+    {
+        if (!w->failed.exchange(true))
+            LOG_WARN(logger, "Worker " + w->getName() + " is disabled: bad number of outputs");
+        return false;
+    }
+
+    for (size_t i = 0; i < r.outputs.size(); i++)
+    {
+        auto &o = r.outputs[i];
+        auto &f = j.outputs[i];
+        if (!o.exists)
+            continue;
+        // worker on this host has already written the same file
+        error_code ec;
+        if (fs::file_size(f, ec) == o.data.size() && !ec && read_file(f) == o.data)
+            continue;
+        writeFileAtomically(f, o.data);
+    }
+
+    c.out.text = r.out;
+    c.err.text = r.err;
+    c.exit_code = (int)r.exit_code;
+    return true;
+}
+
+Dispatcher *getDispatcher()
+{
+    static auto d = []() -> std::unique_ptr<Dispatcher>
+    {
+        if (workers.empty())
+            return {};
+        return std::make_unique<Dispatcher>(Strings(workers.begin(), workers.end()), (int)getExecutor().numberOfThreads());
+    }();
+    return d.get();
+}
+
+static Result run(const Job &j, ResourcePool &pool)
+{
+    pool.lock();
+    SCOPE_EXIT
+    {
+        pool.unlock();
+    };
+
+    primitives::Command c;
+    c.program = j.program;
+    c.args = j.args;
+    c.working_directory = j.working_directory;
+    for (auto &[k, v] : j.environment)
+        c.environment[k] = v;
+    c.in.file = j.in;
+    c.out.file = j.out;
+    c.err.file = j.err;
+    for (auto &o : j.outputs)
+        fs::create_directories(o.parent_path());
+
+    std::error_code ec;
+    c.execute(ec);
+
+    Result r;
+    r.exit_code = c.exit_code.value_or(-1);
+    r.out = c.out.text;
+    r.err = c.err.text;
+    if (ec && !c.exit_code)
+        r.err += ec.message();
+    for (auto &o : j.outputs)
+    {
+        Result::Output ro;
+        ro.exists = fs::exists(o);
+        if (ro.exists)
+            ro.data = read_file(o);
+        r.outputs.push_back(std::move(ro));
+    }
+    return r;
+}
+
+// inputs the worker has written itself, it may replace them when they change
+struct ShippedInputs
+{
+    struct Input
+    {
+        String hash;
+        int users = 0;
+        bool written = false;
+    };
+
+    std::mutex m;
+    std::map<path, Input> files;
+};
+
+static void serve(tcp::socket &s, ResourcePool &pool, int jobs, ShippedInputs &shipped)
+{
+    try
+    {
+        s.set_option(tcp::no_delay(true));
+
+        Writer w;
+        w.write(DISTRIBUTED_PROTOCOL_VERSION);
+        w.write((uint64_t)jobs);
+        send(s, MessageType::Hello, w.s);
+
+        while (1)
+        {
+            String payload;
+            if (receive(s, payload) != MessageType::Job)
+                throw std::runtime_error("Job expected");
+            Job j;
+            j.load(payload);
+
+            if (getContentHash(j.program) != j.program_hash)
+            {
+                send(s, MessageType::Reject, "program differs: " + j.program.u8string());
+                continue;
+            }
+
+            // files of others are never overwritten, missing ones are created
+            // and ours are replaced when no running job uses them
+            std::set<uint64_t> missing;
+            std::vector<ShippedInputs::Input *> used;
+            String reason;
+            {
+                std::unique_lock<std::mutex> lk(shipped.m);
+                for (size_t i = 0; i < j.inputs.size(); i++)
+                {
+                    auto &[p, h] = j.inputs[i];
+                    if (auto si = shipped.files.find(p); si != shipped.files.end())
+                    {
+                        auto &in = si->second;
+                        if (in.hash == h && in.written)
+                            continue;
+                        if (in.users)
+                        {
+                            reason = "input is in use: " + p.u8string();
+                            break;
+                        }
+                        missing.insert(i);
+                        continue;
+                    }
+                    auto h2 = getContentHash(p);
+                    if (h2 == h)
+                        continue;
+                    if (h2 != "-")
+                    {
+                        reason = "input differs: " + p.u8string();
+                        break;
+                    }
+                    missing.insert(i);
+                }
+                if (reason.empty())
+                {
+                    for (size_t i = 0; i < j.inputs.size(); i++)
+                    {
+                        auto &[p, h] = j.inputs[i];
+                        ShippedInputs::Input *in = nullptr;
+                        if (missing.find(i) != missing.end())
+                        {
+                            in = &shipped.files[p];
+                            in->hash = h;
+                            in->written = false;
+                        }
+                        else if (auto si = shipped.files.find(p); si != shipped.files.end())
+                            in = &si->second;
+                        if (!in)
+                            continue;
+                        in->users++;
+                        used.push_back(in);
+                    }
+                }
+            }
+            if (!reason.empty())
+            {
+                send(s, MessageType::Reject, reason);
+                continue;
+            }
+            SCOPE_EXIT
+            {
+                std::unique_lock<std::mutex> lk(shipped.m);
+                for (auto in : used)
+                {
+                    in->users--;
+                    // interrupted transfer, content is unknown now
+                    if (!in->written)
+                        in->hash.clear();
+                }
+            };
+
+            if (!missing.empty())
+            {
+                Writer w;
+                w.write(missing.size());
+                for (auto i : missing)
+                    w.write(i);
+                send(s, MessageType::NeedInputs, w.s);
+
+                if (receive(s, payload) != MessageType::Inputs)
+                    throw std::runtime_error("Inputs expected");
+                Reader rd(payload);
+                for (auto n = rd.u64(); n--;)
+                {
+                    auto i = rd.u64();
+                    auto data = rd.str();
+                    if (missing.find(i) == missing.end())
+                        throw std::runtime_error("Input was not requested");
+                    writeFileAtomically(j.inputs[i].first, data);
+                    missing.erase(i);
+                }
+                if (!missing.empty())
+                    throw std::runtime_error("Not all inputs were sent");
+
+                std::unique_lock<std::mutex> lk(shipped.m);
+                for (auto in : used)
+                    in->written = true;
+            }
+
+            send(s, MessageType::Result, run(j, pool).save());
+        }
+    }
+    catch (std::exception &e)
+    {
+        // disconnects end up here too
+        LOG_TRACE(logger, e.what());
+    }
+}
+
+void runWorker(const String &address, int jobs)
+{
+    auto [host, port] = splitAddress(address);
+
+    boost::asio::io_context ctx;
+    tcp::resolver r(ctx);
+    tcp::acceptor a(ctx, r.resolve(host, port).begin()->endpoint());
+
+    ResourcePool pool;
+    pool.setLimit(jobs);
+    ShippedInputs shipped;
+
+    LOG_INFO(logger, "Listening on " + address + ", jobs: " + std::to_string(jobs));
+    while (1)
+    {
+        tcp::socket s(ctx);
+        a.accept(s);
+        std::thread([s = std::move(s), &pool, jobs, &shipped]() mutable
+        {
+            serve(s, pool, jobs, shipped);
+        }).detach();
+    }
+}
+
+}
@@ -0,0 +1,50 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <sw/builder/command.h>
+
+namespace sw
+{
+
+/// ships distributable commands to remote workers (sw worker)
+///
+/// Job carries program, args, wdir, env and input files by content hash.
+/// Worker asks for inputs it does not have, runs the command
+/// with the same paths and sends back outputs, side outputs and stdout/stderr.
+struct SW_BUILDER_API Dispatcher
+{
+    // local commands, executor is oversubscribed in dispatcher mode
+    ResourcePool local;
+
+    Dispatcher(const Strings &workers, int local_jobs);
+    Dispatcher(const Dispatcher &) = delete;
+    Dispatcher &operator=(const Dispatcher &) = delete;
+    ~Dispatcher();
+
+    /// number of jobs all workers can run at once
+    size_t getJobs() const;
+
+    /// returns false if no worker can take the command or it failed there, run it locally then
+    bool execute(builder::Command &c, const path &rsp_file = {});
+
+private:
+    struct Worker;
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::atomic_size_t next{ 0 };
+};
+
+/// returns nullptr when no workers are set
+SW_BUILDER_API
+Dispatcher *getDispatcher();
+
+/// serves dispatchers on host:port, never returns
+SW_BUILDER_API
+void runWorker(const String &address, int jobs);
+
+}
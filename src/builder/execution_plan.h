@@ -10,6 +10,11 @@
 #include <exceptions.h>
 
 #include <primitives/debug.h>
+#include <primitives/templates.h>
+
+#include <condition_variable>
+#include <deque>
+#include <thread>
 
 template <class T>
 struct ExecutionPlan
@@ -17,95 +22,79 @@ struct ExecutionPlan
     using PtrT = std::shared_ptr<T>;
     using USet = std::unordered_set<PtrT>;
 
-    std::vector<PtrT> commands;
-
-    ExecutionPlan() = default;
-    ExecutionPlan(const ExecutionPlan &) = delete;
-    ExecutionPlan(ExecutionPlan &&) = default;
-    ~ExecutionPlan()
+    // compressed sparse rows, ids are indices into commands
+    struct Edges
     {
-        // break commands
-        for (auto &c : commands)
+        struct Range
         {
-            c->dependendent_commands.clear();
-            c->dependencies.clear();
-        }
-    }
-
-    void execute(Executor &e) const
-    {
-        std::mutex m;
-        std::vector<Future<void>> fs;
-        std::vector<Future<void>> all;
-        std::atomic_bool stopped = false;
+            const uint32_t *b = nullptr;
+            const uint32_t *e = nullptr;
 
-        std::function<void(T*)> run;
-        run = [&e, &run, &fs, &all, &m, &stopped](T *c)
-        {
-            if (stopped)
-                return;
-            try
-            {
-                c->execute();
-            }
-            catch (...)
-            {
-                stopped = true;
-                throw;
-            }
-            for (auto &d : c->dependendent_commands)
-            {
-                if (--d->dependencies_left == 0)
-                {
-                    std::unique_lock<std::mutex> lk(m);
-                    fs.push_back(e.push([&run, d] {run(d.get()); }));
-                    all.push_back(fs.back());
-                }
-            }
+            const uint32_t *begin() const { return b; }
+            const uint32_t *end() const { return e; }
+            size_t size() const { return e - b; }
+            bool empty() const { return b == e; }
         };
 
-        // run commands without deps
-        {
-            std::unique_lock<std::mutex> lk(m);
-            for (auto &c : commands)
-            {
-                if (!c->dependencies.empty())
-                    break;
-                fs.push_back(e.push([&run, c] {run(c.get()); }));
-                all.push_back(fs.back());
-            }
-        }
+        std::vector<uint32_t> offsets;
+        std::vector<uint32_t> ids;
 
-        // wait for all commands until exception
-        int i = 0;
-        auto sz = commands.size();
-        std::vector<std::exception_ptr> eptrs;
-        while (i != sz)
+        Range operator[](size_t i) const
         {
-            std::vector<Future<void>> fs2;
-            {
-                std::unique_lock<std::mutex> lk(m);
-                fs2 = fs;
-                fs.clear();
-            }
-            for (auto &f : fs2)
-            {
-                i++;
-                f.wait();
-            }
-            if (stopped)
-                break;
+            return { ids.data() + offsets[i], ids.data() + offsets[i + 1] };
         }
+    };
+
+    std::vector<PtrT> commands;
+    // frozen graph, built at the end of plan creation
+    Edges dependencies;
+    Edges dependents;
+
+    ExecutionPlan() = default;
+    ExecutionPlan(const ExecutionPlan &) = delete;
+    ExecutionPlan(ExecutionPlan &&) = default;
 
-        // gather exceptions
-        for (auto &f : all)
+    // dispatcher mode: remote_jobs commands may run on remote workers at once,
+    // their workers mostly wait on sockets, so they get own threads;
+    // local_jobs limits local workers below executor size
+    void execute(Executor &e, size_t remote_jobs = 0, size_t local_jobs = 0) const
+    {
+        if (commands.empty())
+            return;
+
+        // state is shared with worker tasks, they may start after we return
+        // (when executor threads are busy), so it must outlive this call
+        auto n_local = std::max<size_t>(1, e.numberOfThreads());
+        if (local_jobs)
+            n_local = std::min(n_local, local_jobs);
+        auto st = std::make_shared<ExecutionState>(*this, n_local + remote_jobs);
+
+        // seed, the longest path to the end is taken first (from the back)
+        size_t n_seed = 0;
+        while (n_seed < commands.size() && dependencies[n_seed].empty())
+            n_seed++;
+        for (auto i = (uint32_t)n_seed; i-- > 0;)
+            st->workers[i % st->workers.size()].q.push_back(i);
+        st->queued = n_seed;
+
+        // this thread is worker 0, so we progress even if executor is busy
+        for (size_t i = 1; i < n_local; i++)
+            e.push([st, i] { st->run(i); });
+        std::vector<std::thread> remote_threads;
+        for (size_t i = n_local; i < st->workers.size(); i++)
+            remote_threads.emplace_back([st, i] { st->run(i); });
+        st->run(0);
+        for (auto &t : remote_threads)
+            t.join();
+
+        // wait for workers that are still finishing their commands
         {
-            if (f.state->eptr)
-                eptrs.push_back(f.state->eptr);
+            std::unique_lock<std::mutex> lk(st->m);
+            st->cv.wait(lk, [&st] { return st->active == 0; });
         }
 
-        if (!eptrs.empty())
-            throw ExceptionVector(eptrs);
+        if (!st->eptrs.empty())
+            throw ExceptionVector(st->eptrs);
     }
 
     StringHashMap<int> gatherStrings() const
@@ -280,84 +269,427 @@ struct ExecutionPlan
 
         // create again
         auto ep = create(cmds);
+        if (!cmds.empty())
+            return ep;
 
-        // set number of deps and dependent commands
+        // critical path: commands are in topological order here,
+        // so go backwards and push values to deps
         for (auto &c : ep.commands)
+            c->critical_path = 0;
+        for (auto i = ep.commands.rbegin(); i != ep.commands.rend(); i++)
         {
-            c->dependencies_left = c->dependencies.size();
+            auto &c = *i;
+            c->critical_path += c->getEstimatedTime();
             for (auto &d : c->dependencies)
-                d->dependendent_commands.insert(c);
+                d->critical_path = std::max(d->critical_path, c->critical_path);
         }
 
-        // improve sorting! it's too stupid
-        // simple "0 0 0 0 1 2 3 6 7 8 9 11" is not enough
-        std::sort(ep.commands.begin(), ep.commands.end(), [](const auto &c1, const auto &c2)
+        // commands without deps go first, execute() relies on this
+        std::stable_sort(ep.commands.begin(), ep.commands.end(), [](const auto &c1, const auto &c2)
         {
-            if (c1->dependencies.size() != c2->dependencies.size())
-                return c1->dependencies.size() < c2->dependencies.size();
-            //if (c1->dependendent_commands.size() != c2->dependendent_commands.size())
-                return c1->dependendent_commands.size() > c2->dependendent_commands.size();
-            //return c1->getName() < c2->getName();
+            if (c1->dependencies.empty() != c2->dependencies.empty())
+                return c1->dependencies.empty();
+            return c1->critical_path > c2->critical_path;
         });
 
+        ep.freeze();
         return ep;// std::move(ep);
     }
 
+    // restores frozen plan, commands must be in plan order
+    static ExecutionPlan createExecutionPlan(std::vector<PtrT> commands, Edges dependencies)
+    {
+        ExecutionPlan ep;
+        ep.commands = std::move(commands);
+        ep.dependencies = std::move(dependencies);
+        ep.dependents = getDependents(ep.dependencies);
+        return ep;
+    }
+
+    // ids and everything that depends on them, sorted (plan order)
+    std::vector<uint32_t> getDependentClosure(std::vector<uint32_t> ids) const
+    {
+        std::vector<bool> seen(commands.size());
+        for (size_t h = 0; h < ids.size(); h++)
+        {
+            if (seen[ids[h]])
+                continue;
+            seen[ids[h]] = true;
+            for (auto d : dependents[ids[h]])
+            {
+                if (!seen[d])
+                    ids.push_back(d);
+            }
+        }
+        std::vector<uint32_t> r;
+        for (uint32_t i = 0; i < commands.size(); i++)
+        {
+            if (seen[i])
+                r.push_back(i);
+        }
+        return r;
+    }
+
+    // plan of sorted ids, deps outside of them are considered done
+    ExecutionPlan getSubplan(const std::vector<uint32_t> &ids) const
+    {
+        std::vector<bool> in(commands.size());
+        for (auto i : ids)
+            in[i] = true;
+        auto is_source = [this, &in](auto i)
+        {
+            for (auto d : dependencies[i])
+            {
+                if (in[d])
+                    return false;
+            }
+            return true;
+        };
+
+        // execute() seeds from the front, so sources go first
+        std::vector<uint32_t> order;
+        order.reserve(ids.size());
+        std::copy_if(ids.begin(), ids.end(), std::back_inserter(order), is_source);
+        std::copy_if(ids.begin(), ids.end(), std::back_inserter(order), [&is_source](auto i) { return !is_source(i); });
+
+        std::vector<uint32_t> pos(commands.size());
+        for (uint32_t i = 0; i < order.size(); i++)
+            pos[order[i]] = i;
+
+        std::vector<PtrT> cmds;
+        Edges deps;
+        deps.offsets.push_back(0);
+        for (auto i : order)
+        {
+            cmds.push_back(commands[i]);
+            for (auto d : dependencies[i])
+            {
+                if (in[d])
+                    deps.ids.push_back(pos[d]);
+            }
+            deps.offsets.push_back((uint32_t)deps.ids.size());
+        }
+        return createExecutionPlan(std::move(cmds), std::move(deps));
+    }
+
 private:
-    static void prepare(USet &cmds)
+    struct ExecutionState
     {
-        // prepare all commands
-        // extract all deps commands
+        struct Worker
+        {
+            std::mutex m;
+            std::deque<uint32_t> q;
+        };
 
-        size_t sz = cmds.size();
-        while (1)
+        const ExecutionPlan &p;
+        std::vector<Worker> workers;
+        std::unique_ptr<std::atomic<uint32_t>[]> dependencies_left;
+        const size_t total;
+        std::atomic_size_t done = 0;
+        std::atomic_size_t queued = 0;
+        std::atomic_size_t active = 0;
+        std::atomic_size_t sleeping = 0;
+        std::atomic_bool stopped = false;
+        std::mutex m;
+        std::condition_variable cv;
+        std::vector<std::exception_ptr> eptrs;
+        // commands waiting for resources or system (see JobControl),
+        // they go back to queues on every release
+        std::mutex blocked_m;
+        std::vector<uint32_t> blocked;
+        std::atomic_size_t releases = 0;
+
+        ExecutionState(const ExecutionPlan &p, size_t n)
+            : p(p), workers(n), dependencies_left(new std::atomic<uint32_t>[p.commands.size()]), total(p.commands.size())
         {
-            for (auto &c : cmds)
-                c->prepare();
-            // separate loop for additional deps tracking (programs, inputs, outputs etc.)
-            auto cmds2 = cmds;
-            for (auto &c : cmds)
+            for (size_t i = 0; i < total; i++)
+                dependencies_left[i] = (uint32_t)p.dependencies[i].size();
+        }
+
+        bool finished() const
+        {
+            return stopped || done == total;
+        }
+
+        bool pop(size_t id, uint32_t &c)
+        {
+            // own deque first, then steal
+            for (size_t i = 0; i < workers.size(); i++)
             {
-                for (auto &d : c->dependencies)
+                auto &w = workers[(id + i) % workers.size()];
+                std::unique_lock<std::mutex> lk(w.m);
+                if (w.q.empty())
+                    continue;
+                // back holds the longest path, so thieves take it too
+                c = w.q.back();
+                w.q.pop_back();
+                queued--;
+                return true;
+            }
+            return false;
+        }
+
+        void push(size_t id, std::vector<uint32_t> &ready)
+        {
+            if (ready.empty())
+                return;
+            std::sort(ready.begin(), ready.end(), [this](auto c1, auto c2)
+            {
+                return p.commands[c1]->critical_path < p.commands[c2]->critical_path;
+            });
+            {
+                auto &w = workers[id];
+                std::unique_lock<std::mutex> lk(w.m);
+                w.q.insert(w.q.end(), ready.begin(), ready.end());
+                // woken workers must find them, pop() takes the same lock,
+                // so the count never goes below zero
+                queued += ready.size();
+            }
+            if (sleeping)
+                notify();
+        }
+
+        bool lockResources(size_t id, uint32_t c)
+        {
+            auto r = releases.load();
+            if (p.commands[c]->tryLockResources())
+                return true;
+            std::unique_lock<std::mutex> lk(blocked_m);
+            // something was released in between, try again
+            if (r != releases)
+            {
+                lk.unlock();
+                return lockResources(id, c);
+            }
+            blocked.push_back(c);
+            return false;
+        }
+
+        void unlockResources(size_t id, uint32_t c)
+        {
+            p.commands[c]->unlockResources();
+            releases++;
+            retryBlocked(id);
+        }
+
+        void retryBlocked(size_t id)
+        {
+            std::vector<uint32_t> ready;
+            {
+                std::unique_lock<std::mutex> lk(blocked_m);
+                ready.swap(blocked);
+            }
+            push(id, ready);
+        }
+
+        void notify()
+        {
+            // empty lock prevents lost wake ups
+            {
+                std::unique_lock<std::mutex> lk(m);
+            }
+            cv.notify_all();
+        }
+
+        void run(size_t id)
+        {
+            active++;
+            SCOPE_EXIT
+            {
+                if (--active == 0 && finished())
+                    notify();
+            };
+
+            std::vector<uint32_t> ready;
+            while (!finished())
+            {
+                uint32_t c;
+                if (!pop(id, c))
+                {
+                    std::unique_lock<std::mutex> lk(m);
+                    sleeping++;
+                    auto woken = cv.wait_for(lk, std::chrono::milliseconds(100), [this] { return queued > 0 || finished(); });
+                    sleeping--;
+                    lk.unlock();
+                    // pools may be also taken outside of this plan, poll them
+                    if (!woken)
+                        retryBlocked(id);
+                    continue;
+                }
+
+                if (!lockResources(id, c))
+                    continue;
+
+                try
+                {
+                    SCOPE_EXIT
+                    {
+                        unlockResources(id, c);
+                    };
+                    p.commands[c]->execute();
+                }
+                catch (...)
+                {
+                    std::unique_lock<std::mutex> lk(m);
+                    eptrs.push_back(std::current_exception());
+                    stopped = true;
+                    lk.unlock();
+                    cv.notify_all();
+                    return;
+                }
+
+                ready.clear();
+                for (auto d : p.dependents[c])
                 {
-                    cmds2.insert(d);
-                    for (auto &d2 : d->dependencies)
-                        cmds2.insert(d2);
+                    if (--dependencies_left[d] == 0)
+                        ready.push_back(d);
                 }
+                push(id, ready);
+
+                if (++done == total)
+                    notify();
             }
-            cmds = cmds2;
+        }
+    };
+
+    static void prepare(USet &cmds)
+    {
+        // prepare all commands and pull in their deps,
+        // every command is prepared only once
+        std::vector<PtrT> q(cmds.begin(), cmds.end());
+        while (!q.empty())
+        {
+            auto c = std::move(q.back());
+            q.pop_back();
+            c->prepare();
+            // additional deps tracking (programs, inputs, outputs etc.)
+            for (auto &d : c->dependencies)
+            {
+                if (cmds.insert(d).second)
+                    q.push_back(d);
+            }
+        }
+    }
 
-            if (cmds.size() == sz)
-                break;
-            sz = cmds.size();
+    // deps outside of nodes are skipped
+    static Edges getDependencies(const std::vector<PtrT> &nodes)
+    {
+        std::unordered_map<T*, uint32_t> ids;
+        ids.reserve(nodes.size());
+        for (auto &c : nodes)
+            ids.emplace(c.get(), (uint32_t)ids.size());
+
+        Edges deps;
+        deps.offsets.reserve(nodes.size() + 1);
+        deps.offsets.push_back(0);
+        for (auto &c : nodes)
+        {
+            for (auto &d : c->dependencies)
+            {
+                auto i = ids.find(d.get());
+                if (i != ids.end())
+                    deps.ids.push_back(i->second);
+            }
+            deps.offsets.push_back((uint32_t)deps.ids.size());
+        }
+        return deps;
+    }
+
+    static Edges getDependents(const Edges &deps)
+    {
+        const auto n = deps.offsets.size() - 1;
+        Edges r;
+        r.offsets.resize(n + 1);
+        for (auto d : deps.ids)
+            r.offsets[d + 1]++;
+        for (size_t i = 0; i < n; i++)
+            r.offsets[i + 1] += r.offsets[i];
+        r.ids.resize(deps.ids.size());
+        auto pos = r.offsets;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            for (auto d : deps[i])
+                r.ids[pos[d]++] = i;
         }
+        return r;
     }
 
+    // commands keep their dependency sets, edges added once in prepare()
+    // are needed by every later plan over the same commands
+    void freeze()
+    {
+        dependencies = getDependencies(commands);
+        dependents = getDependents(dependencies);
+    }
+
+    // Kahn's algorithm on dense ids
+    // on cycles, leaves only commands taking part in them in cmds
     static ExecutionPlan<T> create(USet &cmds)
     {
-        ExecutionPlan<T> ep;
-        while (!cmds.empty())
+        const auto n = cmds.size();
+        std::vector<PtrT> nodes(cmds.begin(), cmds.end());
+        auto deps = getDependencies(nodes);
+        auto dependents = getDependents(deps);
+
+        std::vector<uint32_t> indegree(n);
+        std::vector<uint32_t> order;
+        order.reserve(n);
+        for (uint32_t i = 0; i < n; i++)
+        {
+            indegree[i] = (uint32_t)deps[i].size();
+            if (indegree[i] == 0)
+                order.push_back(i);
+        }
+        for (size_t h = 0; h < order.size(); h++)
         {
-            bool added = false;
-            for (auto it = cmds.begin(); it != cmds.end();)
+            for (auto d : dependents[order[h]])
             {
-                if (std::all_of((*it)->dependencies.begin(), (*it)->dependencies.end(),
-                    [&cmds](auto &d) { return cmds.find(d) == cmds.end(); }))
-                {
-                    added = true;
-                    ep.commands.push_back(*it);
-                    it = cmds.erase(it);
-                }
-                else
-                    it++;
+                if (--indegree[d] == 0)
+                    order.push_back(d);
             }
-            if (!added)
+        }
+
+        ExecutionPlan<T> ep;
+        ep.commands.reserve(order.size());
+        for (auto u : order)
+            ep.commands.push_back(nodes[u]);
+        if (order.size() == n)
+        {
+            cmds.clear();
+            return ep;
+        }
+
+        // cycle: commands with indegree left are cycles and everything after them,
+        // so peel off from the other side those that nothing left depends on
+        std::vector<uint32_t> outdegree(n);
+        std::vector<uint32_t> peel;
+        for (uint32_t i = 0; i < n; i++)
+        {
+            if (indegree[i] == 0)
+                continue;
+            for (auto d : dependents[i])
+                outdegree[i] += indegree[d] != 0;
+            if (outdegree[i] == 0)
+                peel.push_back(i);
+        }
+        while (!peel.empty())
+        {
+            auto u = peel.back();
+            peel.pop_back();
+            indegree[u] = 0;
+            for (auto d : deps[u])
             {
-                // We failed with stupid algorithm, now we must perform smarter.
-                // Shall we?
-                return ep;
+                if (indegree[d] != 0 && --outdegree[d] == 0)
+                    peel.push_back(d);
             }
         }
+
+        cmds.clear();
+        for (uint32_t i = 0; i < n; i++)
+        {
+            if (indegree[i] != 0)
+                cmds.insert(nodes[i]);
+        }
         return ep;
     }
 };
@@ -22,6 +22,9 @@
 #include <primitives/debug.h>
 #include <primitives/sw/settings.h>
 
+#include <xxhash.h>
+
+#include <shared_mutex>
 #include <sstream>
 
 #include <primitives/log.h>
@@ -30,6 +33,8 @@ DECLARE_STATIC_LOGGER(logger, "file");
 #define CPPAN_FILES_EXPLAIN_FILE (getUserDirectories().storage_dir_tmp / "explain.txt")
 
 static cl::opt<bool> explain_outdated("explain-outdated", cl::desc("Explain outdated files"));
+static cl::opt<bool> early_cutoff("early-cutoff", cl::desc("Do not rebuild dependents of regenerated files with the same content"));
+static cl::opt<bool> content_hashes("content-hashes", cl::desc("Check contents of source files with changed mtime"));
 
 namespace sw
 {
@@ -51,18 +56,115 @@ void explainMessage(const String &subject, bool outdated, const String &reason,
     });
 }
 
-String getCurrentModuleNameHash();
+// dependency sets and dependents lists are changed exclusively,
+// max times are computed under shared lock
+static std::shared_mutex max_time_mutex;
+
+static String getFileHash(const path &p)
+{
+    auto fp = primitives::filesystem::fopen(p, "rb");
+    if (!fp)
+        throw std::runtime_error("Cannot open file: " + p.u8string());
+    SCOPE_EXIT
+    {
+        fclose(fp);
+    };
+
+    auto s = XXH3_createState();
+    SCOPE_EXIT
+    {
+        XXH3_freeState(s);
+    };
+    XXH3_128bits_reset(s);
+
+    std::vector<char> buf(1 << 16);
+    size_t n;
+    while ((n = fread(buf.data(), 1, buf.size(), fp)) > 0)
+        XXH3_128bits_update(s, buf.data(), n);
+    if (ferror(fp))
+        throw std::runtime_error("Cannot read file: " + p.u8string());
+
+    XXH128_canonical_t c;
+    XXH128_canonicalFromHash(&c, XXH3_128bits_digest(s));
+    static const char hex[] = "0123456789abcdef";
+    String h;
+    for (auto b : c.digest)
+    {
+        h += hex[b >> 4];
+        h += hex[b & 0xF];
+    }
+    return h;
+}
+
+// returns false if file does not exist
+static bool getLastWriteTime(const path &p, fs::file_time_type &t, error_code &ec)
+{
+    t = fs::last_write_time(p, ec);
+    if (!ec)
+        return true;
+    if (ec == std::errc::no_such_file_or_directory || ec == std::errc::not_a_directory)
+        ec.clear();
+    return false;
+}
+
+bool useContentHashes()
+{
+    return content_hashes;
+}
+
+void updateHashes(const std::unordered_set<FileRecord *> &files)
+{
+    auto &e = getExecutor();
+    Futures<void> futures;
+    for (auto f : files)
+        futures.push_back(e.push([f] { f->updateHash(); }));
+    waitAndGet(futures);
+}
+
+void statFiles(const std::unordered_set<FileRecord *> &files)
+{
+    // one task per file is too much for cheap calls
+    static const size_t batch_size = 256;
+
+    // records of different configs share data
+    std::vector<std::pair<FileData *, const path *>> data;
+    data.reserve(files.size());
+    for (auto f : files)
+    {
+        if (f->data && !f->file.empty())
+            data.emplace_back(f->data, &f->file);
+    }
+    std::sort(data.begin(), data.end());
+    data.erase(std::unique(data.begin(), data.end(), [](auto &a, auto &b) { return a.first == b.first; }), data.end());
+
+    auto &e = getExecutor();
+    Futures<void> futures;
+    for (size_t i = 0; i < data.size(); i += batch_size)
+    {
+        futures.push_back(e.push([&data, i]
+        {
+            auto end = std::min(i + batch_size, data.size());
+            for (auto j = i; j < end; j++)
+            {
+                auto &[d, p] = data[j];
+                error_code ec;
+                d->stat_exists = getLastWriteTime(*p, d->stat_time, ec);
+                // errors are reported by refresh()
+                if (!ec)
+                    d->stat_ready = true;
+            }
+        }));
+    }
+    waitAndGet(futures);
+}
 
-path getFilesLogFileName(const String &config)
+void discardStats(const std::unordered_set<FileRecord *> &files)
 {
-    auto cfg = sha256_short(getCurrentModuleNameHash() + "_" + config);
-    const path bp = getUserDirectories().storage_dir_tmp / ("files_" + cfg + ".log");
-    auto p = bp.parent_path() / bp.filename().stem();
-    std::ostringstream ss;
-    //ss << "." << sha256_short(boost::dll::program_location().string());
-    p += ss.str();
-    p += bp.extension();
-    return p;
+    for (auto f : files)
+    {
+        if (f->data)
+            f->data->stat_ready = false;
+    }
 }
 
 File::File(FileStorage &s)
@@ -124,10 +226,7 @@ void File::addExplicitDependency(const path &p)
         return;
     registerSelf();
     File f(p, *fs);
-    // FIXME:
-    static std::mutex m;
-    std::unique_lock<std::mutex> lk(m);
-    r->explicit_dependencies.emplace(p, f.r);
+    r->addExplicitDependency(internPath(p), f.r);
 }
 
 void File::addExplicitDependency(const Files &files)
@@ -142,29 +241,50 @@ void File::addImplicitDependency(const path &p)
         return;
     registerSelf();
     File f(p, *fs);
-    // FIXME:
-    static std::mutex m;
-    std::unique_lock<std::mutex> lk(m);
-    r->implicit_dependencies.emplace(p, f.r);
+    r->addImplicitDependencies({ { internPath(p), f.r } });
 }
 
 void File::addImplicitDependency(const Files &files)
 {
+    FileDependencies deps;
     for (auto &p : files)
-        addImplicitDependency(p);
+    {
+        if (!p.empty())
+            deps.emplace_back(internPath(p), File(p, *fs).r);
+    }
+    addImplicitDependencies(deps);
+}
+
+void File::addImplicitDependencies(const FileDependencies &deps)
+{
+    registerSelf();
+    r->addImplicitDependencies(deps);
+}
+
+FileDependencies getFileDependencies(FileStorage &fs, const std::vector<std::string_view> &files)
+{
+    FileDependencies deps;
+    deps.reserve(files.size());
+    for (auto &f : files)
+    {
+        if (f.empty())
+            continue;
+        path p(f);
+        deps.emplace_back(internPath(p), &File(p, fs).getFileRecord());
+    }
+    return deps;
 }
 
 void File::clearDependencies()
 {
     registerSelf();
-    r->explicit_dependencies.clear();
-    r->implicit_dependencies.clear();
+    r->clearDependencies();
 }
 
 void File::clearImplicitDependencies()
 {
     registerSelf();
-    r->implicit_dependencies.clear();
+    r->clearImplicitDependencies();
 }
 
 FileRecord &File::getFileRecord()
@@ -212,8 +332,10 @@ FileData::FileData(const FileData &rhs)
 FileData &FileData::operator=(const FileData &rhs)
 {
     last_write_time = rhs.last_write_time;
-    size = rhs.size;
     hash = rhs.hash;
+    hash_time = rhs.hash_time;
+    size = rhs.size;
+    content_time = rhs.content_time;
     flags = rhs.flags;
 
     refreshed = rhs.refreshed.load();
@@ -273,12 +395,18 @@ void FileRecord::load(const path &p)
         file = p;
     if (file.empty() || !data)
         return;
+    // file was written, pre-execution stat is stale
+    data->stat_ready = false;
     if (!fs::exists(file))
         return;
     auto lwt = fs::last_write_time(file);
     if (lwt < data->last_write_time)
         return;
-    data->last_write_time = lwt;
+    if (lwt != data->last_write_time)
+    {
+        data->last_write_time = lwt;
+        invalidateMaxTime();
+    }
     //size = fs::file_size(file);
     // do not calc hashes on the first run
     // we do this on the first mismatch
@@ -326,7 +454,22 @@ bool FileRecord::refresh(bool use_file_monitor)
         d->refresh(use_file_monitor);
     }
 
-    if (!fs::exists(file))
+    fs::file_time_type t;
+    bool exists;
+    if (data->stat_ready.exchange(false))
+    {
+        exists = data->stat_exists;
+        t = data->stat_time;
+    }
+    else
+    {
+        error_code ec;
+        exists = getLastWriteTime(file, t, ec);
+        if (ec)
+            throw fs::filesystem_error("cannot get last write time", file, ec);
+    }
+
+    if (!exists)
     {
         EXPLAIN_OUTDATED("file", true, "not found", file.u8string());
         return true;
@@ -336,9 +479,19 @@ bool FileRecord::refresh(bool use_file_monitor)
 
     //DEBUG_BREAK_IF_PATH_HAS(file, "basename-lgpl.c");
 
-    auto t = fs::last_write_time(file);
     if (t > data->last_write_time)
     {
+        // touched or checked out again
+        if (content_hashes && !isGenerated())
+        {
+            updateHash();
+            if (data->content_time <= data->last_write_time)
+            {
+                EXPLAIN_OUTDATED("file", false, "mtime changed, contents are the same", file.u8string());
+                return false;
+            }
+        }
+
         if (data->last_write_time.time_since_epoch().count() != 0)
             EXPLAIN_OUTDATED("file", true, "last_write_time changed on disk from " +
                 std::to_string(data->last_write_time.time_since_epoch().count()) + " to " +
@@ -346,6 +499,7 @@ bool FileRecord::refresh(bool use_file_monitor)
         else
             EXPLAIN_OUTDATED("file", true, "empty last_write_time", file.u8string());
         data->last_write_time = t;
+        invalidateMaxTime();
         result = true;
     }
 
@@ -370,6 +524,7 @@ bool FileRecord::isChanged(bool use_file_monitor)
             std::to_string(data->last_write_time.time_since_epoch().count()) + " to " +
             std::to_string(t.time_since_epoch().count()), file.u8string());
         data->last_write_time = t;
+        invalidateMaxTime();
         c = true;
     }
 
@@ -410,46 +565,196 @@ bool FileRecord::isGenerated() const
     return !!generator.lock();
 }
 
-fs::file_time_type FileRecord::getMaxTime() const
+template <class F>
+static void forEachDependency(const FileRecord &r, F &&f)
 {
-    std::unordered_set<FileData*> files;
-    return getMaxTime1(files);
+    for (auto &[_, d] : r.explicit_dependencies)
+    {
+        if (d != &r && d && d->data)
+            f(d, "explicit ");
+    }
+    for (auto &[_, d] : r.implicit_dependencies)
+    {
+        if (d != &r && d && d->data)
+            f(d, "implicit ");
+    }
 }
 
-fs::file_time_type FileRecord::getMaxTime1(std::unordered_set<FileData*> &files) const
+fs::file_time_type FileRecord::getMaxTime() const
 {
-    auto m = data->last_write_time;
-    for (auto &[f, d] : explicit_dependencies)
+    std::shared_lock lk(max_time_mutex);
+    fs::file_time_type t;
+    if (getMaxTimeMemo(t))
+        return std::max(data->last_write_time, t);
+
+    // records without memo in topological order, deps go first
+    auto traverse = [](const FileRecord *d)
     {
-        if (d == this)
+        fs::file_time_type t;
+        return !(early_cutoff && d->isGenerated()) && !d->getMaxTimeMemo(t);
+    };
+    std::unordered_set<const FileRecord *> visited;
+    std::vector<const FileRecord *> order;
+    std::vector<std::pair<const FileRecord *, bool /* deps pushed */>> stack{ { this, false } };
+    while (!stack.empty())
+    {
+        auto [r, expanded] = stack.back();
+        if (expanded)
+        {
+            stack.pop_back();
+            order.push_back(r);
             continue;
-        if (files.find(d->data) != files.end() || !d->data)
+        }
+        if (!visited.insert(r).second)
+        {
+            // reached by another path meanwhile
+            stack.pop_back();
             continue;
-        files.insert(d->data);
-        //auto dm = d->data->last_write_time;
-        auto dm = d->getMaxTime1(files);
-        if (dm > m)
+        }
+        stack.back().second = true;
+        forEachDependency(*r, [&](const FileRecord *d, const char *)
         {
-            m = dm;
-            EXPLAIN_OUTDATED("file", true, "explicit " + f.u8string() + " is newer", file.u8string());
+            if (visited.find(d) == visited.end() && traverse(d))
+                stack.emplace_back(d, false);
+        });
+    }
+
+    // memo is the max time of deps, own time is added on return,
+    // so records of other configurations sharing FileData stay valid on its changes
+    std::unordered_map<const FileRecord *, std::pair<fs::file_time_type, bool /* complete */>> times;
+    for (auto r : order)
+    {
+        auto m = fs::file_time_type::min();
+        bool complete = true;
+        forEachDependency(*r, [&](const FileRecord *d, const char *type)
+        {
+            fs::file_time_type dm;
+            if (early_cutoff && d->isGenerated())
+                dm = d->getContentTime();
+            else if (auto i = times.find(d); i != times.end())
+            {
+                dm = std::max(d->data->last_write_time, i->second.first);
+                complete &= i->second.second;
+            }
+            else if (d->getMaxTimeMemo(dm))
+                dm = std::max(d->data->last_write_time, dm);
+            else
+            {
+                // cycle, its max time is not known yet, so do not remember ours
+                dm = d->data->last_write_time;
+                complete = false;
+            }
+            if (dm > m)
+            {
+                m = dm;
+                if (m > r->data->last_write_time)
+                    EXPLAIN_OUTDATED("file", true, type + d->file.u8string() + " is newer", r->file.u8string());
+            }
+        });
+        times[r] = { m, complete };
+        if (complete)
+            r->max_time = m.time_since_epoch().count();
+    }
+    return std::max(data->last_write_time, times[this].first);
+}
+
+bool FileRecord::getMaxTimeMemo(fs::file_time_type &t) const
+{
+    auto m = max_time.load();
+    if (m == no_max_time)
+        return false;
+    t = fs::file_time_type(fs::file_time_type::duration(m));
+    return true;
+}
+
+void FileRecord::invalidateMaxTime()
+{
+    std::unique_lock lk(max_time_mutex);
+    invalidateMaxTime1();
+}
+
+void FileRecord::invalidateMaxTime1()
+{
+    max_time = no_max_time;
+    if (!data)
+        return;
+    // dependents are computed from memos of their deps, so behind a record
+    // without memo there are only records without memo (early cutoff ones
+    // use content time instead and are reached when it changes)
+    std::vector<FileData *> q{ data };
+    while (!q.empty())
+    {
+        auto d = q.back();
+        q.pop_back();
+        for (auto r : d->dependents)
+        {
+            if (r->max_time.exchange(no_max_time) != no_max_time && r->data)
+                q.push_back(r->data);
         }
     }
-    for (auto &[f, d] : implicit_dependencies)
+}
+
+void FileRecord::addExplicitDependency(PathId p, FileRecord *d)
+{
+    std::unique_lock lk(max_time_mutex);
+    if (explicit_dependencies.emplace(p, d).second && d && d->data)
+        d->data->dependents.push_back(this);
+    invalidateMaxTime1();
+}
+
+void FileRecord::addImplicitDependencies(const FileDependencies &deps)
+{
+    std::unique_lock lk(max_time_mutex);
+    implicit_dependencies.reserve(implicit_dependencies.size() + deps.size());
+    for (auto &[p, d] : deps)
     {
-        if (d == this)
-            continue;
-        if (files.find(d->data) != files.end() || !d->data)
+        if (implicit_dependencies.emplace(p, d).second && d && d->data)
+            d->data->dependents.push_back(this);
+    }
+    invalidateMaxTime1();
+}
+
+void FileRecord::clearDependencies()
+{
+    std::unique_lock lk(max_time_mutex);
+    removeDependents(explicit_dependencies);
+    removeDependents(implicit_dependencies);
+    explicit_dependencies.clear();
+    implicit_dependencies.clear();
+    invalidateMaxTime1();
+}
+
+void FileRecord::clearImplicitDependencies()
+{
+    std::unique_lock lk(max_time_mutex);
+    removeDependents(implicit_dependencies);
+    implicit_dependencies.clear();
+    invalidateMaxTime1();
+}
+
+void FileRecord::removeDependents(const std::unordered_map<PathId, FileRecord *> &deps)
+{
+    for (auto &[_, d] : deps)
+    {
+        if (!d || !d->data)
             continue;
-        files.insert(d->data);
-        //auto dm = d->data->last_write_time;
-        auto dm = d->getMaxTime1(files);
-        if (dm > m)
+        auto &v = d->data->dependents;
+        if (auto i = std::find(v.begin(), v.end(), this); i != v.end())
         {
-            m = dm;
-            EXPLAIN_OUTDATED("file", true, "implicit " + f.u8string() + " is newer", file.u8string());
+            *i = v.back();
+            v.pop_back();
         }
     }
-    return m;
+}
+
+void FileRecord::registerDependents()
+{
+    std::unique_lock lk(max_time_mutex);
+    forEachDependency(*this, [this](FileRecord *d, const char *)
+    {
+        d->data->dependents.push_back(this);
+    });
+    invalidateMaxTime1();
 }
 
 fs::file_time_type FileRecord::updateLwt()
@@ -470,7 +775,8 @@ fs::file_time_type FileRecord::updateLwt1(std::unordered_set<FileData*> &files)
         if (files.find(d->data) != files.end() || !d->data)
             continue;
         files.insert(d->data);
-        auto dm = d->updateLwt1(files);
+        // generated files are updated by their commands
+        auto dm = early_cutoff && d->isGenerated() ? d->getContentTime() : d->updateLwt1(files);
         if (dm > m)
             m = dm;
     }
@@ -481,14 +787,58 @@ fs::file_time_type FileRecord::updateLwt1(std::unordered_set<FileData*> &files)
         if (files.find(d->data) != files.end() || !d->data)
             continue;
         files.insert(d->data);
-        auto dm = d->updateLwt1(files);
+        auto dm = early_cutoff && d->isGenerated() ? d->getContentTime() : d->updateLwt1(files);
         if (dm > m)
             m = dm;
     }
-    data->last_write_time = m;
+    if (m != data->last_write_time)
+    {
+        data->last_write_time = m;
+        invalidateMaxTime();
+    }
     return m;
 }
 
+bool FileRecord::updateHash()
+{
+    error_code ec;
+    auto t = fs::last_write_time(file, ec);
+    if (ec)
+        return false;
+    auto sz = (int64_t)fs::file_size(file, ec);
+    if (ec)
+        return false;
+    if (!data->hash.empty() && data->hash_time == t && data->size == sz)
+        return false;
+
+    auto h = getFileHash(file);
+    bool changed = h != data->hash;
+    data->hash_time = t;
+    data->size = sz;
+    if (changed)
+    {
+        data->hash = h;
+        // generated files are newer than their deps, sources may be newer than the record
+        data->content_time = std::max(data->last_write_time, t);
+        invalidateMaxTime();
+    }
+    fs->async_file_log(this);
+    return changed;
+}
+
+void FileRecord::updateContentHash()
+{
+    if (early_cutoff && data)
+        updateHash();
+}
+
+fs::file_time_type FileRecord::getContentTime() const
+{
+    if (data->hash.empty())
+        return data->last_write_time;
+    return data->content_time;
+}
+
 bool FileRecord::operator<(const FileRecord &r) const
 {
     return data->last_write_time < r.data->last_write_time;
@@ -6,14 +6,18 @@
 
 #pragma once
 
+#include "path_interner.h"
+
 #include <enums.h>
 #include <node.h>
 
 #include <primitives/filesystem.h>
 
 #include <atomic>
+#include <limits>
 #include <mutex>
 #include <optional>
+#include <string_view>
 
 namespace sw
 {
@@ -28,6 +32,9 @@ struct Command;
 struct FileRecord;
 struct FileStorage;
 
+// resolved once, so they can be added to many files
+using FileDependencies = std::vector<std::pair<PathId, FileRecord *>>;
+
 struct SW_BUILDER_API File : virtual Node
 {
     FileStorage *fs = nullptr;
@@ -45,6 +52,7 @@ struct SW_BUILDER_API File : virtual Node
     void addExplicitDependency(const Files &f);
     void addImplicitDependency(const path &f);
     void addImplicitDependency(const Files &f);
+    void addImplicitDependencies(const FileDependencies &deps);
     void clearDependencies();
     void clearImplicitDependencies();
     std::unordered_set<std::shared_ptr<builder::Command>> gatherDependentGenerators() const;
@@ -74,13 +82,27 @@ enum FileFlags
 struct FileData
 {
     fs::file_time_type last_write_time;
-    int64_t size = -1;
+    // xxh3-128 of contents, see FileRecord::updateHash()
     String hash;
+    // mtime and size on disk when hash was calculated
+    fs::file_time_type hash_time;
+    int64_t size = -1;
+    // last_write_time when hash was changed
+    fs::file_time_type content_time;
     SomeFlags flags;
 
     // if file info is updated during this run
     std::atomic_bool refreshed{ false };
 
+    // stat results of the pre-execution pass, first refresh() takes them
+    std::atomic_bool stat_ready{ false };
+    bool stat_exists = false;
+    fs::file_time_type stat_time;
+
+    // records having this file in deps, their max times depend on it
+    // (of all configurations, so may be more than needed)
+    std::vector<FileRecord *> dependents;
+
     FileData() = default;
     FileData(const FileData &);
     FileData &operator=(const FileData &rhs);
@@ -94,9 +116,9 @@ struct SW_BUILDER_API FileRecord
     path file;
     FileData *data = nullptr;
 
-    // make sets?
-    std::unordered_map<path, FileRecord *> explicit_dependencies;
-    std::unordered_map<path, FileRecord *> implicit_dependencies;
+    // keys are interned, thousands of files share the same headers
+    std::unordered_map<PathId, FileRecord *> explicit_dependencies;
+    std::unordered_map<PathId, FileRecord *> implicit_dependencies;
 
     FileRecord() = default;
     FileRecord(const FileRecord &);
@@ -117,24 +139,70 @@ struct SW_BUILDER_API FileRecord
 
     //private:
     std::atomic_bool saved{ false };
+    // of the record last written to files db, see FileDb::write()
+    mutable std::atomic<uint64_t> saved_digest{ 0 };
 
     /// get last write time of this file and all deps
     fs::file_time_type getMaxTime() const;
 
+    /// call on every change of file times, memoized max times of dependents are dropped
+    void invalidateMaxTime();
+
+    void addExplicitDependency(PathId p, FileRecord *d);
+    void addImplicitDependencies(const FileDependencies &deps);
+    void clearDependencies();
+    void clearImplicitDependencies();
+
+    /// makes deps set directly (e.g. on load) known to max time memo
+    void registerDependents();
+
     /// returns true if file was changed
     bool refresh(bool use_file_monitor = true);
 
     fs::file_time_type updateLwt();
 
+    /// recalculates hash if mtime or size on disk changed,
+    /// returns true if contents are changed
+    bool updateHash();
+
+    /// early cutoff: dependents see generated files as changed
+    /// only when their content changes
+    void updateContentHash();
+    fs::file_time_type getContentTime() const;
+
 private:
     std::weak_ptr<builder::Command> generator;
     bool generated_ = false;
 
-    fs::file_time_type getMaxTime1(std::unordered_set<FileData*> &files) const;
+    static constexpr auto no_max_time = std::numeric_limits<fs::file_time_type::rep>::max();
+
+    // getMaxTime() memo, no_max_time when unknown
+    mutable std::atomic<fs::file_time_type::rep> max_time{ no_max_time };
+
+    bool getMaxTimeMemo(fs::file_time_type &t) const;
+    void invalidateMaxTime1();
+    void removeDependents(const std::unordered_map<PathId, FileRecord *> &deps);
     fs::file_time_type updateLwt1(std::unordered_set<FileData*> &files);
 };
 
-path getFilesLogFileName(const String &config = {});
+SW_BUILDER_API
+FileDependencies getFileDependencies(FileStorage &fs, const std::vector<std::string_view> &files);
+
+/// with --content-hashes files with new mtime and the same contents are not changed
+SW_BUILDER_API
+bool useContentHashes();
+
+/// calls updateHash() for files on the executor
+SW_BUILDER_API
+void updateHashes(const std::unordered_set<FileRecord *> &files);
+
+/// stats files on the executor in batches, so outdated checks do not go to disk
+SW_BUILDER_API
+void statFiles(const std::unordered_set<FileRecord *> &files);
+
+/// drops stats not taken by refresh(), they are stale after the build
+SW_BUILDER_API
+void discardStats(const std::unordered_set<FileRecord *> &files);
 
 #define EXPLAIN_OUTDATED(subject, outdated, reason, name) \
     explainMessage(subject, outdated, reason, name)
@@ -20,12 +20,33 @@ namespace sw
 int useFileMonitor = 1;
 static Executor async_executor("async log writer", 1);
 
+static std::mutex file_change_m;
+static std::vector<FileChangeHandler> file_change_handlers;
+// for refreshChangedFiles()
+static bool track_changes;
+static std::unordered_set<FileData *> changed_files;
+
 primitives::filesystem::FileMonitor &get_file_monitor()
 {
     static primitives::filesystem::FileMonitor fm;
     return fm;
 }
 
+void addFileChangeHandler(FileChangeHandler h)
+{
+    std::unique_lock lk(file_change_m);
+    file_change_handlers.push_back(std::move(h));
+}
+
+static void notifyFileChanged(FileRecord &r)
+{
+    std::unique_lock lk(file_change_m);
+    if (track_changes && r.data)
+        changed_files.insert(r.data);
+    for (auto &h : file_change_handlers)
+        h(r);
+}
+
 FileStorage::file_holder::file_holder(const path &fn)
     : f(fn, "ab")
 {
@@ -39,18 +60,34 @@ FileStorage::file_holder::file_holder(const path &fn)
     fseek(f.getHandle(), 0, SEEK_END);
 }
 
-FileStorage::file_holder::~file_holder()
-{
-    error_code ec;
-    fs::remove(fn, ec);
-}
-
 ConcurrentHashMap<path, FileData> &getFileData()
 {
     static ConcurrentHashMap<path, FileData> file_data;
     return file_data;
 }
 
+void resetRefreshedFiles()
+{
+    for (auto i = getFileData().getIterator(); i.isValid(); i.next())
+        i.getValue()->refreshed = false;
+}
+
+void refreshChangedFiles()
+{
+    std::unique_lock lk(file_change_m);
+    if (!useFileMonitor || !track_changes)
+    {
+        track_changes = useFileMonitor;
+        changed_files.clear();
+        lk.unlock();
+        resetRefreshedFiles();
+        return;
+    }
+    for (auto d : changed_files)
+        d->refreshed = false;
+    changed_files.clear();
+}
+
 std::map<String, FileStorage> &getFileStorages()
 {
     getFileData();
@@ -79,7 +116,7 @@ FileStorage::FileStorage(const String &config)
 FileStorage::file_holder *FileStorage::getLog()
 {
     if (!async_log)
-        async_log = std::make_unique<file_holder>(getFilesLogFileName(config));
+        async_log = std::make_unique<file_holder>(getDb().getLogFile(config));
     return async_log.get();
 }
 
@@ -87,8 +124,9 @@ FileStorage::~FileStorage()
 {
     try
     {
-        async_log.reset();
+        // pending async records are written by save() too
         save();
+        async_log.reset();
     }
     catch (std::exception &e)
     {
@@ -110,6 +148,19 @@ void FileStorage::async_file_log(const FileRecord *r)
     });
 }
 
+void FileStorage::writeLog(const std::vector<uint8_t> &v)
+{
+    // the log has one writer
+    async_executor.push([this, &v]
+    {
+        if (v.empty())
+            return;
+        auto l = getLog();
+        fwrite(&v[0], v.size(), 1, l->f.getHandle());
+        fflush(l->f.getHandle());
+    }).get();
+}
+
 void FileStorage::load()
 {
     getDb().load(*this, files);
@@ -118,6 +169,8 @@ void FileStorage::load()
     {
         auto &f = *i.getValue();
         f.fs = this;
+        // deps were set directly
+        f.registerDependents();
     }
 }
 
@@ -178,9 +231,13 @@ FileRecord *FileStorage::registerFile(const File &in_f)
             auto &r = File(f, *this).getFileRecord();
             error_code ec;
             if (fs::exists(r.file, ec))
+            {
                 r.data->last_write_time = fs::last_write_time(f);
+                r.invalidateMaxTime();
+            }
             else
                 r.data->refreshed = false;
+            notifyFileChanged(r);
         });
     }
 
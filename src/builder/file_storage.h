@@ -9,6 +9,8 @@
 #include "concurrent_map.h"
 #include "file.h"
 
+#include <functional>
+
 namespace sw
 {
 
@@ -17,10 +19,8 @@ struct SW_BUILDER_API FileStorage
     struct file_holder
     {
         ScopedFile f;
-        path fn;
 
         file_holder(const path &fn);
-        ~file_holder();
     };
 
     String config;
@@ -39,6 +39,8 @@ struct SW_BUILDER_API FileStorage
     FileRecord *registerFile(const path &f);
 
     void async_file_log(const FileRecord *r);
+    // after records queued by async_file_log(), waits for all of them
+    void writeLog(const std::vector<uint8_t> &v);
 
 private:
     std::unique_ptr<file_holder> async_log;
@@ -52,4 +54,19 @@ FileStorage &getFileStorage(const String &config);
 SW_BUILDER_API
 std::map<String, FileStorage> &getFileStorages();
 
+/// files are checked on disk again by the next run in this process
+SW_BUILDER_API
+void resetRefreshedFiles();
+
+/// same for files the file monitor reported since the previous call,
+/// for processes serving many builds; all files on the first call or without monitor
+SW_BUILDER_API
+void refreshChangedFiles();
+
+/// called from the file monitor thread after the record is updated
+using FileChangeHandler = std::function<void(FileRecord &)>;
+
+SW_BUILDER_API
+void addFileChangeHandler(FileChangeHandler h);
+
 }
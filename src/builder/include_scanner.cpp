@@ -0,0 +1,396 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "include_scanner.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cwctype>
+#include <deque>
+#include <mutex>
+
+namespace sw
+{
+
+namespace
+{
+
+// preprocessor directives only, the rest of the code is skipped
+struct Lexer
+{
+    std::string_view s;
+    size_t i = 0;
+
+    Lexer(std::string_view s) : s(s) {}
+
+    bool end() const { return i >= s.size(); }
+    char peek(size_t o = 0) const { return i + o < s.size() ? s[i + o] : 0; }
+
+    bool continuation()
+    {
+        if (peek() != '\\')
+            return false;
+        if (peek(1) == '\n')
+        {
+            i += 2;
+            return true;
+        }
+        if (peek(1) == '\r' && peek(2) == '\n')
+        {
+            i += 3;
+            return true;
+        }
+        return false;
+    }
+
+    void skipSpaces()
+    {
+        while (!end())
+        {
+            if (peek() == ' ' || peek() == '\t' || peek() == '\r')
+                i++;
+            else if (!continuation())
+                break;
+        }
+    }
+
+    void skipLine()
+    {
+        while (!end() && peek() != '\n')
+        {
+            if (!continuation())
+                i++;
+        }
+    }
+
+    void skipBlockComment()
+    {
+        i += 2;
+        while (!end() && !(peek() == '*' && peek(1) == '/'))
+            i++;
+        i += 2;
+    }
+
+    void skipLiteral(char q)
+    {
+        i++;
+        while (!end() && peek() != q && peek() != '\n')
+        {
+            if (peek() == '\\')
+                i++;
+            i++;
+        }
+        // unterminated one ends at the line end
+        if (peek() == q)
+            i++;
+    }
+
+    void skipRawString()
+    {
+        // R"delim( ... )delim"
+        i += 2;
+        auto p = s.find('(', i);
+        if (p == s.npos)
+        {
+            i = s.size();
+            return;
+        }
+        String close = ")" + String(s.substr(i, p - i)) + "\"";
+        p = s.find(close, p);
+        i = p == s.npos ? s.size() : p + close.size();
+    }
+
+    std::string_view identifier()
+    {
+        auto b = i;
+        while (!end() && (isalnum((unsigned char)peek()) || peek() == '_'))
+            i++;
+        return s.substr(b, i - b);
+    }
+
+    // the rest of directive line without comments
+    String rest()
+    {
+        String r;
+        while (!end() && peek() != '\n')
+        {
+            if (continuation())
+                continue;
+            if (peek() == '/' && peek(1) == '/')
+            {
+                skipLine();
+                break;
+            }
+            if (peek() == '/' && peek(1) == '*')
+            {
+                skipBlockComment();
+                continue;
+            }
+            r += s[i++];
+        }
+        while (!r.empty() && isspace((unsigned char)r.back()))
+            r.pop_back();
+        return r;
+    }
+
+    // after #if 0, stops after matching #else, #elif or #endif
+    void skipBlock()
+    {
+        int depth = 0;
+        while (!end())
+        {
+            skipSpaces();
+            if (peek() != '#')
+            {
+                skipLine();
+                i++;
+                continue;
+            }
+            i++;
+            skipSpaces();
+            auto d = identifier();
+            skipLine();
+            i++;
+            if (d == "if" || d == "ifdef" || d == "ifndef")
+                depth++;
+            else if (d == "endif")
+            {
+                if (depth-- == 0)
+                    return;
+            }
+            else if ((d == "else" || d == "elif") && depth == 0)
+                return;
+        }
+    }
+};
+
+}
+
+IncludeScanner::Parsed IncludeScanner::parseIncludes(std::string_view s)
+{
+    Parsed p;
+    Lexer l(s);
+    bool line_start = true;
+    while (!l.end())
+    {
+        auto c = l.peek();
+        if (c == '\n')
+        {
+            line_start = true;
+            l.i++;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\r' || l.continuation())
+        {
+            if (c != '\\')
+                l.i++;
+            continue;
+        }
+        if (c == '/' && l.peek(1) == '/')
+        {
+            l.skipLine();
+            continue;
+        }
+        if (c == '/' && l.peek(1) == '*')
+        {
+            l.skipBlockComment();
+            continue;
+        }
+        if (c == '#' && line_start)
+        {
+            l.i++;
+            l.skipSpaces();
+            auto d = l.identifier();
+            if (d == "include" || d == "include_next" || d == "import")
+            {
+                l.skipSpaces();
+                auto q = l.peek();
+                if (q == '"' || q == '<')
+                {
+                    auto e = l.s.find(q == '"' ? '"' : '>', l.i + 1);
+                    auto nl = l.s.find('\n', l.i + 1);
+                    if (e != l.s.npos && e < nl)
+                        p.includes.push_back({ String(l.s.substr(l.i + 1, e - l.i - 1)), q == '"' });
+                }
+                else
+                    p.computed = true;
+                l.skipLine();
+            }
+            else if (d == "if")
+            {
+                l.skipSpaces();
+                if (l.rest() == "0")
+                {
+                    l.skipLine();
+                    l.i++;
+                    l.skipBlock();
+                    continue;
+                }
+            }
+            else
+                l.skipLine();
+            line_start = false;
+            continue;
+        }
+
+        line_start = false;
+        if (c == '"')
+            l.skipLiteral('"');
+        // not a digit separator, 1'000
+        else if (c == '\'' && (l.i == 0 || !isalnum((unsigned char)s[l.i - 1])))
+            l.skipLiteral('\'');
+        else if (c == 'R' && l.peek(1) == '"')
+            l.skipRawString();
+        else
+            l.i++;
+    }
+    return p;
+}
+
+std::shared_ptr<const IncludeScanner::Parsed> IncludeScanner::parse(const path &f)
+{
+    {
+        std::shared_lock lk(m);
+        if (auto i = files.find(f); i != files.end())
+            return i->second;
+    }
+
+    auto p = std::make_shared<Parsed>(parseIncludes(read_file(f)));
+
+    std::unique_lock lk(m);
+    return files.emplace(f, p).first->second;
+}
+
+// file systems there are case insensitive
+static path getListingName(const path &p)
+{
+#if defined(_WIN32) || defined(__APPLE__)
+    auto s = p.wstring();
+    std::transform(s.begin(), s.end(), s.begin(), towlower);
+    return s;
+#else
+    return p;
+#endif
+}
+
+bool IncludeScanner::exists(const path &f)
+{
+    auto dir = f.parent_path();
+    std::shared_ptr<const Listing> l;
+    {
+        std::shared_lock lk(m);
+        if (auto i = dirs.find(dir); i != dirs.end())
+            l = i->second;
+    }
+    if (!l)
+    {
+        // one listing instead of a stat for every include dir of every include
+        auto nl = std::make_shared<Listing>();
+        error_code ec;
+        for (auto &e : fs::directory_iterator(dir, ec))
+            nl->insert(getListingName(e.path().filename()));
+        std::unique_lock lk(m);
+        l = dirs.emplace(dir, nl).first->second;
+    }
+    return l->find(getListingName(f.filename())) != l->end();
+}
+
+path IncludeScanner::resolve(const Include &i, const path &includer, const FilesOrdered &include_dirs, const Files &generated)
+{
+    auto check = [this, &i, &generated](const path &dir)
+    {
+        auto f = (dir / i.name).lexically_normal();
+        if (generated.find(f) != generated.end() || exists(f))
+            return f;
+        return path();
+    };
+
+    if (i.quoted)
+    {
+        if (auto f = check(includer.parent_path()); !f.empty())
+            return f;
+    }
+    for (auto &d : include_dirs)
+    {
+        if (auto f = check(d); !f.empty())
+            return f;
+    }
+    return {};
+}
+
+IncludeScanner::Result IncludeScanner::scan(const path &source, const FilesOrdered &forced_includes, const FilesOrdered &include_dirs, const Files &generated)
+{
+    Result r;
+    auto src = source.lexically_normal();
+    std::deque<path> q;
+    q.push_back(src);
+    for (auto &fi : forced_includes)
+    {
+        // relative ones are searched in the working dir first, it is not known here
+        auto f = fi.is_absolute() ? fi.lexically_normal() : resolve({ fi.string(), false }, src, include_dirs, generated);
+        if (f.empty() || (generated.find(f) == generated.end() && !exists(f)))
+        {
+            r.complete = false;
+            continue;
+        }
+        if (r.includes.insert(f).second)
+            q.push_back(std::move(f));
+    }
+    while (!q.empty())
+    {
+        auto f = std::move(q.front());
+        q.pop_front();
+
+        // old contents are parsed, but the generator may add includes before compilation
+        bool gen = generated.find(f) != generated.end();
+        if (gen)
+            r.complete = false;
+
+        std::shared_ptr<const Parsed> p;
+        if (!gen || fs::exists(f))
+        {
+            try
+            {
+                p = parse(f);
+            }
+            catch (std::exception &)
+            {
+            }
+        }
+        if (!p)
+        {
+            r.complete = false;
+            continue;
+        }
+
+        if (p->computed)
+            r.complete = false;
+        for (auto &i : p->includes)
+        {
+            auto fi = resolve(i, f, include_dirs, generated);
+            if (fi.empty() || fi == src)
+                continue;
+            if (r.includes.insert(fi).second)
+                q.push_back(std::move(fi));
+        }
+    }
+    return r;
+}
+
+void IncludeScanner::clear()
+{
+    std::unique_lock lk(m);
+    files.clear();
+    dirs.clear();
+}
+
+IncludeScanner &getIncludeScanner()
+{
+    static IncludeScanner s;
+    return s;
+}
+
+}
@@ -0,0 +1,75 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+#include <memory>
+#include <string_view>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace sw
+{
+
+/// finds includes of sources before they are compiled
+///
+/// Conditional blocks are not evaluated (except #if 0), so result is
+/// a superset of real includes. Angle includes not found in include dirs
+/// are system ones and skipped. Parsed files and directory listings
+/// are cached for the whole run, scan() may be called from many threads.
+struct SW_BUILDER_API IncludeScanner
+{
+    struct Result
+    {
+        // existing or generated files
+        Files includes;
+        // generated files (their generators may change them before compilation),
+        // computed includes (#include MACRO) or unresolved forced includes were seen
+        bool complete = true;
+    };
+
+    struct Include
+    {
+        String name;
+        bool quoted;
+    };
+
+    struct Parsed
+    {
+        std::vector<Include> includes;
+        bool computed = false;
+    };
+
+    /// forced includes (-include, /FI) are processed before the source,
+    /// generated files are found even if they do not exist yet,
+    /// both they and include dirs must be lexically normal
+    Result scan(const path &source, const FilesOrdered &forced_includes, const FilesOrdered &include_dirs, const Files &generated);
+
+    /// files may change between builds of one process (daemon, watch)
+    void clear();
+
+    /// includes of one file, no filesystem access
+    static Parsed parseIncludes(std::string_view s);
+
+private:
+    using Listing = std::unordered_set<path>;
+
+    std::shared_mutex m;
+    std::unordered_map<path, std::shared_ptr<const Parsed>> files;
+    std::unordered_map<path, std::shared_ptr<const Listing>> dirs;
+
+    std::shared_ptr<const Parsed> parse(const path &f);
+    bool exists(const path &f);
+    path resolve(const Include &i, const path &includer, const FilesOrdered &include_dirs, const Files &generated);
+};
+
+SW_BUILDER_API
+IncludeScanner &getIncludeScanner();
+
+}
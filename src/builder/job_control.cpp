@@ -0,0 +1,126 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "job_control.h"
+
+#include <primitives/sw/settings.h>
+
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <memory>
+#include <thread>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <stdlib.h>
+#endif
+
+static cl::opt<bool> adaptive_jobs("adaptive-jobs", cl::desc("Start less commands on memory pressure or high system load"));
+
+namespace sw
+{
+
+SystemPressure getSystemPressure()
+{
+    SystemPressure p;
+    p.cpus = std::max(1u, std::thread::hardware_concurrency());
+#ifdef _WIN32
+    MEMORYSTATUSEX ms;
+    ms.dwLength = sizeof(ms);
+    if (GlobalMemoryStatusEx(&ms))
+        p.memory_available = ms.ullAvailPhys / 1024 / 1024;
+#else
+    double load[1];
+    if (getloadavg(load, 1) == 1)
+        p.load = load[0];
+#endif
+#ifdef __linux__
+    std::ifstream meminfo("/proc/meminfo");
+    String k;
+    uint64_t v;
+    while (meminfo >> k >> v)
+    {
+        if (k == "MemAvailable:")
+        {
+            p.memory_available = v / 1024; // kB
+            break;
+        }
+        meminfo.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+
+    // some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+    std::ifstream psi("/proc/pressure/memory");
+    String some, avg10;
+    if (psi >> some >> avg10 && some == "some" && avg10.find("avg10=") == 0)
+        p.memory_stall = std::stod(avg10.substr(6));
+#endif
+    return p;
+}
+
+JobControl::JobControl(Provider provider)
+    : provider(provider)
+{
+}
+
+bool JobControl::tryStart(uint64_t memory)
+{
+    if (!memory)
+        memory = memory_unknown;
+
+    std::unique_lock<std::mutex> lk(m);
+    auto now = std::chrono::steady_clock::now();
+    if (!sampled || now - last >= interval)
+    {
+        pressure = provider();
+        last = now;
+        sampled = true;
+        pending = 0;
+    }
+
+    auto start = [this, memory]
+    {
+        running++;
+        pending += memory;
+        return true;
+    };
+
+    if (running == 0)
+        return start();
+    if (pressure.memory_stall > memory_stall_limit)
+        return false;
+    if (pressure.memory_available && pressure.memory_available < memory_reserve + pending + memory)
+        return false;
+    if (pressure.load > pressure.cpus)
+    {
+        // our commands are in the load too
+        auto other = std::max(0.0, pressure.load - running);
+        if (running >= std::max(1.0, pressure.cpus - other))
+            return false;
+    }
+    return start();
+}
+
+void JobControl::finish()
+{
+    std::unique_lock<std::mutex> lk(m);
+    running--;
+}
+
+JobControl *getJobControl()
+{
+    static auto jc = []() -> std::unique_ptr<JobControl>
+    {
+        if (!adaptive_jobs)
+            return {};
+        return std::make_unique<JobControl>();
+    }();
+    return jc.get();
+}
+
+}
@@ -0,0 +1,68 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <primitives/string.h>
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+namespace sw
+{
+
+/// what other processes leave to us
+struct SystemPressure
+{
+    uint64_t memory_available = 0; // MB, 0 = unknown
+    double memory_stall = 0; // % of time tasks waited for memory (psi some avg10)
+    double load = 0; // 1 min load average
+    size_t cpus = 1;
+};
+
+/// reads /proc/meminfo, /proc/pressure/memory and load average
+SW_BUILDER_API
+SystemPressure getSystemPressure();
+
+/// throttles starts of new commands, executor size stays the upper bound
+struct SW_BUILDER_API JobControl
+{
+    using Provider = std::function<SystemPressure(void)>;
+
+    // keep this much memory free for the rest of the system, MB
+    uint64_t memory_reserve = 512;
+    // stop starting new commands above this stall %
+    double memory_stall_limit = 10;
+    // estimate for commands without history, MB
+    uint64_t memory_unknown = 256;
+    // how often to ask provider
+    std::chrono::milliseconds interval{ 250 };
+
+    JobControl(Provider provider = getSystemPressure);
+
+    /// memory is estimated peak of the command, MB, 0 = unknown
+    /// at least one command is always allowed, so we never stall
+    bool tryStart(uint64_t memory);
+    void finish();
+
+private:
+    Provider provider;
+    std::mutex m;
+    size_t running = 0;
+    SystemPressure pressure;
+    std::chrono::steady_clock::time_point last;
+    bool sampled = false;
+    // estimates of commands started after the last sample,
+    // they are not visible in the system numbers yet
+    uint64_t pending = 0;
+};
+
+/// returns nullptr when adaptive mode is off
+SW_BUILDER_API
+JobControl *getJobControl();
+
+}
@@ -0,0 +1,87 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace sw
+{
+
+MappedFile::MappedFile(const path &fn)
+{
+#ifdef _WIN32
+    file = CreateFileW(fn.wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Cannot open file: " + fn.u8string());
+    LARGE_INTEGER s;
+    if (!GetFileSizeEx(file, &s))
+    {
+        CloseHandle(file);
+        throw std::runtime_error("Cannot get file size: " + fn.u8string());
+    }
+    sz = (size_t)s.QuadPart;
+    if (sz == 0)
+        return;
+    mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping)
+        p = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!p)
+    {
+        if (mapping)
+            CloseHandle(mapping);
+        CloseHandle(file);
+        throw std::runtime_error("Cannot map file: " + fn.u8string());
+    }
+#else
+    auto fd = open(fn.string().c_str(), O_RDONLY);
+    if (fd == -1)
+        throw std::runtime_error("Cannot open file: " + fn.u8string());
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+    {
+        close(fd);
+        throw std::runtime_error("Cannot get file size: " + fn.u8string());
+    }
+    sz = (size_t)st.st_size;
+    if (sz)
+    {
+        auto m = mmap(nullptr, sz, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED)
+        {
+            close(fd);
+            throw std::runtime_error("Cannot map file: " + fn.u8string());
+        }
+        p = (const uint8_t *)m;
+    }
+    // mapping stays valid after close
+    close(fd);
+#endif
+}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+    if (p)
+        UnmapViewOfFile(p);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file)
+        CloseHandle(file);
+#else
+    if (p)
+        munmap((void *)p, sz);
+#endif
+}
+
+}
@@ -0,0 +1,34 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+namespace sw
+{
+
+/// read only view of the whole file
+struct SW_BUILDER_API MappedFile
+{
+    MappedFile(const path &fn);
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+    ~MappedFile();
+
+    const uint8_t *data() const { return p; }
+    size_t size() const { return sz; }
+
+private:
+    const uint8_t *p = nullptr;
+    size_t sz = 0;
+#ifdef _WIN32
+    void *file = nullptr;
+    void *mapping = nullptr;
+#endif
+};
+
+}
@@ -0,0 +1,111 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "path_interner.h"
+
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+namespace sw
+{
+
+namespace
+{
+
+using PathView = std::basic_string_view<path::value_type>;
+
+// paths live in chunks that never move, ids are indices
+const size_t chunk_bits = 16;
+const size_t chunk_size = 1 << chunk_bits;
+const size_t max_chunks = 1 << (32 - chunk_bits);
+// lookups of different paths do not wait for each other
+const size_t n_shards = 64;
+
+struct PathInterner
+{
+    struct Shard
+    {
+        std::mutex m;
+        std::unordered_map<PathView, PathId> ids;
+    };
+
+    Shard shards[n_shards];
+    std::unique_ptr<std::atomic<path *>[]> chunks{ new std::atomic<path *>[max_chunks] };
+    std::mutex chunks_m;
+    std::atomic<uint64_t> next{ 0 };
+
+    PathInterner()
+    {
+        for (size_t i = 0; i < max_chunks; i++)
+            chunks[i] = nullptr;
+    }
+
+    PathId intern(const path &p)
+    {
+        PathView v = p.native();
+        auto &s = shards[std::hash<PathView>()(v) % n_shards];
+        std::unique_lock lk(s.m);
+        if (auto i = s.ids.find(v); i != s.ids.end())
+            return i->second;
+
+        auto id = next++;
+        if (id > std::numeric_limits<PathId>::max())
+            throw std::runtime_error("Too many paths");
+        auto &slot = getSlot((PathId)id);
+        slot = p;
+        s.ids.emplace(PathView(slot.native()), (PathId)id);
+        return (PathId)id;
+    }
+
+    path &getSlot(PathId id)
+    {
+        auto &c = chunks[id >> chunk_bits];
+        if (!c)
+        {
+            std::unique_lock lk(chunks_m);
+            if (!c)
+                c = new path[chunk_size];
+        }
+        return c.load()[id & (chunk_size - 1)];
+    }
+
+    const path &get(PathId id) const
+    {
+        if (id >= next)
+            throw std::runtime_error("Unknown path id: " + std::to_string(id));
+        return chunks[id >> chunk_bits].load()[id & (chunk_size - 1)];
+    }
+};
+
+PathInterner &getPathInterner()
+{
+    // never destroyed, paths may be used during static destruction
+    static auto i = new PathInterner;
+    return *i;
+}
+
+}
+
+PathId internPath(const path &p)
+{
+    return getPathInterner().intern(p);
+}
+
+const path &getInternedPath(PathId id)
+{
+    return getPathInterner().get(id);
+}
+
+size_t getInternedPathsCount()
+{
+    return getPathInterner().next;
+}
+
+}
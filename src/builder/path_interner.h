@@ -0,0 +1,29 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <primitives/filesystem.h>
+
+namespace sw
+{
+
+/// process-wide 32-bit ids of paths
+/// equal paths get equal ids, interned paths are never freed,
+/// so references (and views of their strings) stay valid
+using PathId = uint32_t;
+
+/// thread safe
+SW_BUILDER_API
+PathId internPath(const path &p);
+
+SW_BUILDER_API
+const path &getInternedPath(PathId id);
+
+SW_BUILDER_API
+size_t getInternedPathsCount();
+
+}
@@ -0,0 +1,115 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "remote_cache.h"
+
+#include <primitives/templates.h>
+
+#include <curl/curl.h>
+
+#include <cstring>
+#include <stdexcept>
+
+namespace sw
+{
+
+namespace
+{
+
+struct ReadData
+{
+    const String *data;
+    size_t pos = 0;
+};
+
+}
+
+static size_t curl_write(char *ptr, size_t size, size_t nmemb, void *userdata)
+{
+    ((String *)userdata)->append(ptr, size * nmemb);
+    return size * nmemb;
+}
+
+static size_t curl_read(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+    auto &d = *(ReadData *)userdata;
+    auto n = std::min(size * nitems, d.data->size() - d.pos);
+    memcpy(buffer, d.data->data() + d.pos, n);
+    d.pos += n;
+    return n;
+}
+
+static long perform(CURL *curl, const String &url)
+{
+    curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5L);
+    // stalled server must not block the build, less than 1 byte/s for 30s aborts
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 30L);
+    auto r = curl_easy_perform(curl);
+    if (r != CURLE_OK)
+        throw std::runtime_error("Remote cache request failed: " + url + ": " + curl_easy_strerror(r));
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    return code;
+}
+
+RemoteCache::RemoteCache(const String &url)
+    : url(url)
+{
+    if (!this->url.empty() && this->url.back() == '/')
+        this->url.pop_back();
+    static const auto r = curl_global_init(CURL_GLOBAL_ALL);
+    if (r != CURLE_OK)
+        throw std::runtime_error("Cannot initialize curl");
+}
+
+bool RemoteCache::get(const String &key, String &data) const
+{
+    auto curl = curl_easy_init();
+    if (!curl)
+        throw std::runtime_error("Cannot create curl handle");
+    SCOPE_EXIT
+    {
+        curl_easy_cleanup(curl);
+    };
+
+    data.clear();
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &data);
+    auto code = perform(curl, url + "/cas/" + key);
+    if (code == 404)
+        return false;
+    if (code != 200)
+        throw std::runtime_error("Remote cache returned http code " + std::to_string(code) + " for " + key);
+    return true;
+}
+
+void RemoteCache::put(const String &key, const String &data) const
+{
+    auto curl = curl_easy_init();
+    if (!curl)
+        throw std::runtime_error("Cannot create curl handle");
+    SCOPE_EXIT
+    {
+        curl_easy_cleanup(curl);
+    };
+
+    String response;
+    ReadData rd{ &data };
+    curl_easy_setopt(curl, CURLOPT_UPLOAD, 1L);
+    curl_easy_setopt(curl, CURLOPT_READFUNCTION, curl_read);
+    curl_easy_setopt(curl, CURLOPT_READDATA, &rd);
+    curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, (curl_off_t)data.size());
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+    auto code = perform(curl, url + "/cas/" + key);
+    if (code / 100 != 2)
+        throw std::runtime_error("Remote cache returned http code " + std::to_string(code) + " for " + key);
+}
+
+}
@@ -0,0 +1,30 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <primitives/string.h>
+
+namespace sw
+{
+
+/// client of a content addressed http cache
+///
+/// GET <url>/cas/<key> returns 200 with blob or 404
+/// PUT <url>/cas/<key> stores blob
+struct RemoteCache
+{
+    RemoteCache(const String &url);
+
+    /// returns false if there is no such blob
+    bool get(const String &key, String &data) const;
+    void put(const String &key, const String &data) const;
+
+private:
+    String url;
+};
+
+}
@@ -0,0 +1,604 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "spawner.h"
+
+#include <primitives/sw/settings.h>
+
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+
+#include <thread>
+#elif defined(__linux__)
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char **environ;
+#endif
+
+static cl::opt<bool> fast_spawn("fast-spawn", cl::desc("Start commands with posix_spawn or CreateProcess where possible"), cl::init(true));
+
+namespace sw
+{
+
+#if !defined(_WIN32) && !defined(__linux__)
+
+bool spawn(primitives::Command &c, std::error_code *ec, ProcessUsage &u, const OutputHandler &on_output)
+{
+    return false;
+}
+
+#elif defined(_WIN32)
+
+namespace
+{
+
+struct Handle
+{
+    HANDLE h = nullptr;
+
+    ~Handle()
+    {
+        close();
+    }
+
+    void close()
+    {
+        if (h && h != INVALID_HANDLE_VALUE)
+            CloseHandle(h);
+        h = nullptr;
+    }
+};
+
+struct Pipe
+{
+    Handle r, w;
+
+    void create()
+    {
+        // only write end goes to the child
+        SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, TRUE };
+        if (!CreatePipe(&r.h, &w.h, &sa, 65536))
+            throw std::runtime_error("Cannot create pipe: " + std::error_code(GetLastError(), std::system_category()).message());
+        SetHandleInformation(r.h, HANDLE_FLAG_INHERIT, 0);
+    }
+};
+
+struct AttributeList
+{
+    std::unique_ptr<uint8_t[]> data;
+    LPPROC_THREAD_ATTRIBUTE_LIST list = nullptr;
+
+    AttributeList()
+    {
+        SIZE_T sz = 0;
+        InitializeProcThreadAttributeList(nullptr, 1, 0, &sz);
+        data = std::make_unique<uint8_t[]>(sz);
+        list = (LPPROC_THREAD_ATTRIBUTE_LIST)data.get();
+        if (!InitializeProcThreadAttributeList(list, 1, 0, &sz))
+            throw std::runtime_error("Cannot create attribute list: " + std::error_code(GetLastError(), std::system_category()).message());
+    }
+
+    ~AttributeList()
+    {
+        DeleteProcThreadAttributeList(list);
+    }
+};
+
+struct CaseInsensitiveLess
+{
+    bool operator()(const std::wstring &a, const std::wstring &b) const
+    {
+        return _wcsicmp(a.c_str(), b.c_str()) < 0;
+    }
+};
+
+}
+
+static std::wstring toWide(const String &s)
+{
+    if (s.empty())
+        return {};
+    auto n = MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), nullptr, 0);
+    std::wstring w(n, 0);
+    MultiByteToWideChar(CP_UTF8, 0, s.data(), (int)s.size(), w.data(), n);
+    return w;
+}
+
+// same rules as CommandLineToArgvW() and msvc crt use
+static void appendArgument(std::wstring &cmd, const std::wstring &a)
+{
+    cmd += L' ';
+    if (!a.empty() && a.find_first_of(L" \t\n\v\"") == a.npos)
+    {
+        cmd += a;
+        return;
+    }
+    cmd += L'"';
+    for (auto i = a.begin();; ++i)
+    {
+        size_t backslashes = 0;
+        for (; i != a.end() && *i == L'\\'; ++i)
+            backslashes++;
+        if (i == a.end())
+        {
+            // closing quote must not be escaped
+            cmd.append(backslashes * 2, L'\\');
+            break;
+        }
+        if (*i == L'"')
+            cmd.append(backslashes * 2 + 1, L'\\');
+        else
+            cmd.append(backslashes, L'\\');
+        cmd += *i;
+    }
+    cmd += L'"';
+}
+
+// commands of one target usually have the same environment
+static const std::wstring &getEnvironment(const primitives::Command &c)
+{
+    static std::mutex m;
+    static std::unordered_map<String, std::unique_ptr<std::wstring>> envs;
+
+    // sorted, so equal environments have equal keys
+    std::map<String, String> vars(c.environment.begin(), c.environment.end());
+    String key;
+    for (auto &[k, v] : vars)
+    {
+        key += k;
+        key += '=';
+        key += v;
+        key += '\0';
+    }
+
+    std::unique_lock lk(m);
+    auto &e = envs[key];
+    if (e)
+        return *e;
+
+    // names are case insensitive, block must be sorted
+    std::map<std::wstring, std::wstring, CaseInsensitiveLess> block;
+    if (auto s = GetEnvironmentStringsW())
+    {
+        for (auto p = s; *p; p += wcslen(p) + 1)
+        {
+            std::wstring v = p;
+            // names of per drive variables like =C:=C:\dir start with '='
+            auto pos = v.find(L'=', 1);
+            if (pos != v.npos)
+                block[v.substr(0, pos)] = v.substr(pos + 1);
+        }
+        FreeEnvironmentStringsW(s);
+    }
+    for (auto &[k, v] : vars)
+        block[toWide(k)] = toWide(v);
+
+    e = std::make_unique<std::wstring>();
+    for (auto &[k, v] : block)
+    {
+        *e += k;
+        *e += L'=';
+        *e += v;
+        *e += L'\0';
+    }
+    *e += L'\0';
+    return *e;
+}
+
+static void readOutput(HANDLE h, String &b, const OutputHandler &on_output)
+{
+    while (1)
+    {
+        auto sz = b.size();
+        b.resize(sz + 65536);
+        DWORD n = 0;
+        // fails with ERROR_BROKEN_PIPE when child closes its end
+        bool eof = !ReadFile(h, b.data() + sz, 65536, &n, nullptr);
+        b.resize(sz + n);
+        if (on_output)
+            on_output(b, eof);
+        if (eof)
+            break;
+    }
+}
+
+bool spawn(primitives::Command &c, std::error_code *ec, ProcessUsage &u, const OutputHandler &on_output)
+{
+    if (!fast_spawn || !c.program.is_absolute())
+        return false;
+    // scripts need cmd.exe, leave them to primitives
+    auto ext = c.program.extension().wstring();
+    if (_wcsicmp(ext.c_str(), L".exe") != 0)
+        return false;
+
+    auto &env = getEnvironment(c);
+
+    auto prog = c.program.wstring();
+    auto cmd = L"\"" + prog + L"\"";
+    for (auto &a : c.args)
+        appendArgument(cmd, toWide(a));
+    auto wdir = c.working_directory.wstring();
+
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), nullptr, TRUE };
+    auto open_file = [&sa](const path &p, bool write)
+    {
+        auto h = CreateFileW(p.wstring().c_str(), write ? GENERIC_WRITE : GENERIC_READ,
+            FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, write ? CREATE_ALWAYS : OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (h == INVALID_HANDLE_VALUE)
+            throw std::runtime_error("Cannot open file: " + p.u8string());
+        return h;
+    };
+
+    Handle in, out, err;
+    Pipe pout, perr;
+    in.h = open_file(c.in.file.empty() ? path("NUL") : c.in.file, false);
+    if (c.out.file.empty())
+        pout.create();
+    else
+        out.h = open_file(c.out.file, true);
+    if (c.err.file.empty())
+        perr.create();
+    else
+        err.h = open_file(c.err.file, true);
+
+    STARTUPINFOEXW si = { 0 };
+    si.StartupInfo.cb = sizeof(si);
+    si.StartupInfo.dwFlags = STARTF_USESTDHANDLES;
+    si.StartupInfo.hStdInput = in.h;
+    si.StartupInfo.hStdOutput = out.h ? out.h : pout.w.h;
+    si.StartupInfo.hStdError = err.h ? err.h : perr.w.h;
+
+    // parallel spawns must not leak our pipe ends into each other's children,
+    // otherwise reads below wait for unrelated processes
+    AttributeList attrs;
+    HANDLE inherit[] = { si.StartupInfo.hStdInput, si.StartupInfo.hStdOutput, si.StartupInfo.hStdError };
+    UpdateProcThreadAttribute(attrs.list, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inherit, sizeof(inherit), nullptr, nullptr);
+    si.lpAttributeList = attrs.list;
+
+    PROCESS_INFORMATION pi = { 0 };
+    if (!CreateProcessW(prog.c_str(), cmd.data(), nullptr, nullptr, TRUE,
+        CREATE_UNICODE_ENVIRONMENT | EXTENDED_STARTUPINFO_PRESENT | CREATE_NO_WINDOW,
+        (LPVOID)env.c_str(), wdir.empty() ? nullptr : wdir.c_str(), &si.StartupInfo, &pi))
+    {
+        auto e = std::error_code(GetLastError(), std::system_category());
+        if (ec)
+        {
+            *ec = e;
+            return true;
+        }
+        throw std::runtime_error("Cannot start " + c.program.u8string() + ": " + e.message());
+    }
+    Handle process, thread;
+    process.h = pi.hProcess;
+    thread.h = pi.hThread;
+    c.pid = pi.dwProcessId;
+    pout.w.close();
+    perr.w.close();
+
+    // reused between commands of this thread
+    thread_local String out_buf, err_buf;
+    out_buf.clear();
+    err_buf.clear();
+    std::thread err_reader;
+    if (perr.r.h)
+        // thread_local, so pass our buffer explicitly
+        err_reader = std::thread([&perr, &b = err_buf] { readOutput(perr.r.h, b, {}); });
+    try
+    {
+        if (pout.r.h)
+            readOutput(pout.r.h, out_buf, on_output);
+    }
+    catch (...)
+    {
+        TerminateProcess(process.h, 1);
+        if (err_reader.joinable())
+            err_reader.join();
+        throw;
+    }
+    if (err_reader.joinable())
+        err_reader.join();
+
+    WaitForSingleObject(process.h, INFINITE);
+
+    FILETIME creation, exit, kernel, user;
+    if (GetProcessTimes(process.h, &creation, &exit, &kernel, &user))
+    {
+        auto ticks = [](const FILETIME &t) { return ((uint64_t)t.dwHighDateTime << 32) | t.dwLowDateTime; };
+        u.cpu_time = (ticks(kernel) + ticks(user)) / 10000; // 100 ns
+    }
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(process.h, &pmc, sizeof(pmc)))
+        u.peak_rss = pmc.PeakWorkingSetSize / 1024;
+
+    if (pout.r.h)
+        c.out.text = out_buf;
+    if (perr.r.h)
+        c.err.text = err_buf;
+
+    DWORD code = 1;
+    GetExitCodeProcess(process.h, &code);
+    c.exit_code = code;
+    if (code == 0)
+        return true;
+
+    if (ec)
+    {
+        *ec = std::error_code(code, std::generic_category());
+        return true;
+    }
+    throw std::runtime_error("Process exited with code " + std::to_string(code));
+}
+
+#else
+
+namespace
+{
+
+// our environment with command variables on top
+struct Environment
+{
+    Strings vars;
+    std::vector<char *> envp;
+};
+
+struct Pipe
+{
+    int fd[2] = { -1, -1 };
+
+    ~Pipe()
+    {
+        close(0);
+        close(1);
+    }
+
+    void create()
+    {
+        if (pipe2(fd, O_CLOEXEC) == -1)
+            throw std::runtime_error("Cannot create pipe: "s + strerror(errno));
+    }
+
+    void close(int i)
+    {
+        if (fd[i] != -1)
+            ::close(fd[i]);
+        fd[i] = -1;
+    }
+};
+
+struct FileActions
+{
+    posix_spawn_file_actions_t fa;
+
+    FileActions() { posix_spawn_file_actions_init(&fa); }
+    ~FileActions() { posix_spawn_file_actions_destroy(&fa); }
+};
+
+struct SpawnAttributes
+{
+    posix_spawnattr_t a;
+
+    SpawnAttributes() { posix_spawnattr_init(&a); }
+    ~SpawnAttributes() { posix_spawnattr_destroy(&a); }
+};
+
+}
+
+// commands of one target usually have the same environment
+static const Environment &getEnvironment(const primitives::Command &c)
+{
+    static std::mutex m;
+    static std::unordered_map<String, std::unique_ptr<Environment>> envs;
+
+    // sorted, so equal environments have equal keys
+    std::map<String, String> vars(c.environment.begin(), c.environment.end());
+    String key;
+    for (auto &[k, v] : vars)
+    {
+        key += k;
+        key += '=';
+        key += v;
+        key += '\0';
+    }
+
+    std::unique_lock lk(m);
+    auto &e = envs[key];
+    if (e)
+        return *e;
+    e = std::make_unique<Environment>();
+    for (auto p = environ; *p; p++)
+    {
+        String s = *p;
+        if (vars.find(s.substr(0, s.find('='))) == vars.end())
+            e->vars.push_back(std::move(s));
+    }
+    for (auto &[k, v] : vars)
+        e->vars.push_back(k + "=" + v);
+    for (auto &v : e->vars)
+        e->envp.push_back(v.data());
+    e->envp.push_back(nullptr);
+    return *e;
+}
+
+static void readOutput(int out, int err, String &out_buf, String &err_buf, const OutputHandler &on_output)
+{
+    pollfd fds[2] = { { out, POLLIN }, { err, POLLIN } };
+    String *bufs[2] = { &out_buf, &err_buf };
+    int open = (out != -1) + (err != -1);
+    while (open)
+    {
+        if (poll(fds, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            throw std::runtime_error("poll failed: "s + strerror(errno));
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if (fds[i].fd == -1 || !fds[i].revents)
+                continue;
+            auto &b = *bufs[i];
+            auto sz = b.size();
+            b.resize(sz + 65536);
+            auto n = read(fds[i].fd, b.data() + sz, 65536);
+            b.resize(sz + std::max<ssize_t>(n, 0));
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                // negative fds are ignored by poll
+                fds[i].fd = -1;
+                open--;
+            }
+            if (i == 0 && on_output)
+                on_output(b, n <= 0);
+        }
+    }
+}
+
+bool spawn(primitives::Command &c, std::error_code *ec, ProcessUsage &u, const OutputHandler &on_output)
+{
+    if (!fast_spawn || !c.program.is_absolute())
+        return false;
+#if !defined(__GLIBC__) || __GLIBC__ < 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ < 29)
+    // no posix_spawn_file_actions_addchdir_np()
+    if (!c.working_directory.empty())
+        return false;
+#endif
+
+    auto &env = getEnvironment(c);
+
+    auto prog = c.program.string();
+    std::vector<char *> argv;
+    argv.push_back(prog.data());
+    for (auto &a : c.args)
+        argv.push_back(a.data());
+    argv.push_back(nullptr);
+
+    // keep strings alive until spawn
+    auto in = c.in.file.empty() ? String("/dev/null") : c.in.file.string();
+    auto out = c.out.file.string();
+    auto err = c.err.file.string();
+    auto wdir = c.working_directory.string();
+
+    Pipe pout, perr;
+    FileActions fa;
+    posix_spawn_file_actions_addopen(&fa.fa, 0, in.c_str(), O_RDONLY, 0);
+    if (out.empty())
+    {
+        pout.create();
+        posix_spawn_file_actions_adddup2(&fa.fa, pout.fd[1], 1);
+    }
+    else
+        posix_spawn_file_actions_addopen(&fa.fa, 1, out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (err.empty())
+    {
+        perr.create();
+        posix_spawn_file_actions_adddup2(&fa.fa, perr.fd[1], 2);
+    }
+    else
+        posix_spawn_file_actions_addopen(&fa.fa, 2, err.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+    // last, redirections are relative to our cwd
+    if (!wdir.empty())
+        posix_spawn_file_actions_addchdir_np(&fa.fa, wdir.c_str());
+#endif
+
+    // executor threads may block signals, children must not inherit that
+    SpawnAttributes sa;
+    sigset_t mask;
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&sa.a, &mask);
+    sigset_t def;
+    sigemptyset(&def);
+    sigaddset(&def, SIGPIPE);
+    posix_spawnattr_setsigdefault(&sa.a, &def);
+    posix_spawnattr_setflags(&sa.a, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    // glibc does clone(CLONE_VM | CLONE_VFORK) here, no page table copies
+    pid_t pid;
+    if (auto r = posix_spawn(&pid, prog.c_str(), &fa.fa, &sa.a, argv.data(), env.envp.data()); r != 0)
+    {
+        if (ec)
+        {
+            *ec = std::error_code(r, std::system_category());
+            return true;
+        }
+        throw std::runtime_error("Cannot start " + prog + ": " + strerror(r));
+    }
+    c.pid = pid;
+    pout.close(1);
+    perr.close(1);
+
+    // reused between commands of this thread
+    thread_local String out_buf, err_buf;
+    out_buf.clear();
+    err_buf.clear();
+    if (out.empty() || err.empty())
+    {
+        try
+        {
+            readOutput(pout.fd[0], perr.fd[0], out_buf, err_buf, on_output);
+        }
+        catch (...)
+        {
+            // do not leave it running or as a zombie
+            kill(pid, SIGKILL);
+            while (wait4(pid, nullptr, 0, nullptr) == -1 && errno == EINTR)
+                ;
+            throw;
+        }
+    }
+
+    int status;
+    rusage ru;
+    while (wait4(pid, &status, 0, &ru) == -1)
+    {
+        if (errno != EINTR)
+            throw std::runtime_error("wait4 failed: "s + strerror(errno));
+    }
+
+    u.cpu_time =
+        (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000 +
+        (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1000;
+    u.peak_rss = ru.ru_maxrss;
+
+    if (out.empty())
+        c.out.text = out_buf;
+    if (err.empty())
+        c.err.text = err_buf;
+
+    int code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    c.exit_code = code;
+    if (code == 0)
+        return true;
+
+    if (ec)
+    {
+        *ec = std::error_code(code, std::generic_category());
+        return true;
+    }
+    if (WIFSIGNALED(status))
+        throw std::runtime_error("Process was killed by signal " + std::to_string(WTERMSIG(status)));
+    throw std::runtime_error("Process exited with code " + std::to_string(code));
+}
+
+#endif
+
+}
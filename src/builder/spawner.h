@@ -0,0 +1,37 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <primitives/command.h>
+
+#include <functional>
+#include <system_error>
+
+namespace sw
+{
+
+/// resources used by one child process
+struct ProcessUsage
+{
+    uint64_t cpu_time = 0; // ms
+    uint64_t peak_rss = 0; // kb
+};
+
+/// called for captured stdout as it arrives, may consume the beginning of buf,
+/// the rest is stored in out.text; last call has eof set
+using OutputHandler = std::function<void(String &buf, bool eof)>;
+
+/// runs command with posix_spawn (linux) or CreateProcess (windows), output is captured
+/// into reused buffers, environment blocks are built once per distinct environment
+///
+/// returns false when command must go through primitives::Command::execute(),
+/// e.g. on other platforms, with --fast-spawn=false, relative program path
+/// or non .exe program on windows
+SW_BUILDER_API
+bool spawn(primitives::Command &c, std::error_code *ec, ProcessUsage &u, const OutputHandler &on_output = {});
+
+}
@@ -0,0 +1,153 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "watch.h"
+
+#include "file_storage.h"
+
+#include <primitives/sw/settings.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "watch");
+
+static cl::opt<int> watch_delay("watch-delay", cl::desc("Wait for more changes before rebuilding (ms)"), cl::init(200));
+
+namespace sw
+{
+
+namespace
+{
+
+struct WatchState
+{
+    std::mutex m;
+    std::condition_variable cv;
+    std::unordered_set<FileData *> changed;
+    size_t events = 0;
+};
+
+// files -> commands to start from when they change
+struct WatchIndex
+{
+    std::unordered_map<FileData *, std::vector<uint32_t>> users;
+    // written by us, changes are ignored
+    std::unordered_set<FileData *> outputs;
+};
+
+}
+
+static WatchIndex buildIndex(const CommandExecutionPlan &p)
+{
+    WatchIndex idx;
+    for (uint32_t i = 0; i < p.commands.size(); i++)
+    {
+        auto &c = *p.commands[i];
+        auto add = [&idx, i](FileRecord &r)
+        {
+            if (r.data)
+                idx.users[r.data].push_back(i);
+        };
+
+        if (!c.program.empty())
+            add(File(c.program, *c.fs).getFileRecord());
+        for (auto &f : c.inputs)
+            add(File(f, *c.fs).getFileRecord());
+        // implicit deps (headers) are known on outputs only
+        for (auto &f : c.outputs)
+        {
+            auto &r = File(f, *c.fs).getFileRecord();
+            idx.outputs.insert(r.data);
+            for (auto &[_, d] : r.explicit_dependencies)
+            {
+                if (d)
+                    add(*d);
+            }
+            for (auto &[_, d] : r.implicit_dependencies)
+            {
+                if (d)
+                    add(*d);
+            }
+        }
+    }
+    return idx;
+}
+
+void watch(CommandExecutionPlan &p, const std::function<void(CommandExecutionPlan &)> &execute)
+{
+    // handlers are never removed, so state is shared with them
+    auto st = std::make_shared<WatchState>();
+    addFileChangeHandler([st](FileRecord &r)
+    {
+        if (!r.data)
+            return;
+        std::unique_lock lk(st->m);
+        st->changed.insert(r.data);
+        st->events++;
+        st->cv.notify_one();
+    });
+
+    auto idx = buildIndex(p);
+    // commands of the failed run, they are tried again on next change
+    std::vector<uint32_t> retry;
+    while (1)
+    {
+        LOG_INFO(logger, "Waiting for changes...");
+
+        std::unordered_set<FileData *> changed;
+        {
+            std::unique_lock lk(st->m);
+            st->cv.wait(lk, [&st] { return !st->changed.empty(); });
+
+            // editors and vcs write several files (or one file several times) at once
+            size_t events;
+            do
+            {
+                events = st->events;
+                st->cv.wait_for(lk, std::chrono::milliseconds(watch_delay));
+            } while (events != st->events);
+
+            changed.swap(st->changed);
+        }
+
+        auto ids = retry;
+        for (auto d : changed)
+        {
+            if (idx.outputs.find(d) != idx.outputs.end())
+                continue;
+            // stat again on the next check
+            d->refreshed = false;
+            if (auto i = idx.users.find(d); i != idx.users.end())
+                ids.insert(ids.end(), i->second.begin(), i->second.end());
+        }
+        if (ids.empty())
+            continue;
+
+        auto closure = p.getDependentClosure(std::move(ids));
+        auto sp = p.getSubplan(closure);
+        for (auto &c : sp.commands)
+            c->resetExecution();
+
+        retry.clear();
+        try
+        {
+            execute(sp);
+        }
+        catch (std::exception &e)
+        {
+            LOG_ERROR(logger, "error during build: " << e.what());
+            retry = std::move(closure);
+        }
+
+        // implicit deps could change
+        idx = buildIndex(p);
+    }
+}
+
+}
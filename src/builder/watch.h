@@ -0,0 +1,26 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include "execution_plan.h"
+
+#include <sw/builder/command.h>
+
+#include <functional>
+
+namespace sw
+{
+
+using CommandExecutionPlan = ExecutionPlan<builder::Command>;
+
+/// keeps plan and file records resident, on file monitor changes
+/// executes only commands affected by them, never returns
+/// p must be executed once before the call
+SW_BUILDER_API
+void watch(CommandExecutionPlan &p, const std::function<void(CommandExecutionPlan &)> &execute);
+
+}
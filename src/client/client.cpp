@@ -5,8 +5,10 @@
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
 #include <command.h>
+#include <daemon.h>
 #include <database.h>
 #include <directories.h>
+#include <distributed.h>
 #include <exceptions.h>
 #include <file.h>
 #include <file_storage.h>
@@ -95,15 +97,12 @@ static cl::opt<bool> verbose("verbose", cl::desc("Verbose output"));
 static cl::opt<bool> trace("trace", cl::desc("Trace output"));
 static cl::opt<int> jobs("j", cl::desc("Number of jobs"), cl::init(-1));
 
-int setup_main(const Strings &args)
+// also applied for every sw daemon request
+static void setup_options()
 {
-    // some initial stuff
-
-    if (!working_directory.empty())
-        fs::current_path(working_directory);
-
     if (jobs > 0)
         getExecutor(jobs);
+    sw::Build::local_jobs = std::max(0, (int)jobs);
 
 #ifdef NDEBUG
     setup_log("INFO");
@@ -115,6 +114,16 @@ int setup_main(const Strings &args)
         setup_log("DEBUG");
     if (trace)
         setup_log("TRACE");
+}
+
+int setup_main(const Strings &args)
+{
+    // some initial stuff
+
+    if (!working_directory.empty())
+        fs::current_path(working_directory);
+
+    setup_options();
 
     getServiceDatabase();
 
@@ -226,6 +235,14 @@ static cl::opt<String> target_build("target", cl::desc("Target to build")/*, cl:
 static cl::opt<String> ide_rebuild("rebuild", cl::desc("Rebuild target"), cl::sub(subcommand_ide));
 static cl::opt<String> ide_clean("clean", cl::desc("Clean target"), cl::sub(subcommand_ide));
 
+static cl::opt<bool> use_daemon("use-daemon", cl::desc("Run build and ide commands on the workspace build daemon"));
+
+// watch commands
+static cl::opt<String> watch_arg(cl::Positional, cl::desc("File or directory to watch"), cl::init("."), cl::sub(subcommand_watch));
+
+// worker commands
+static cl::opt<String> worker_address("listen", cl::desc("Address to listen on (host:port)"), cl::init("127.0.0.1:8090"), cl::sub(subcommand_worker));
+
 static cl::list<String> override_package("override-remote-package", cl::value_desc("prefix sdir"), cl::desc("Provide a local copy of remote package"), cl::multi_val(2));
 static cl::opt<String> delete_overridden_package("delete-overridden-remote-package", cl::value_desc("package"), cl::desc("Delete overridden package from index"));
 static cl::opt<path> delete_overridden_package_dir("delete-overridden-remote-package-dir", cl::value_desc("sdir"), cl::desc("Delete overridden dir packages"));
@@ -234,6 +251,12 @@ static cl::opt<path> delete_overridden_package_dir("delete-overridden-remote-pac
 
 int sw_main(const Strings &args)
 {
+    if (use_daemon && (subcommand_build || subcommand_ide))
+    {
+        if (auto r = runOnDaemon(fs::current_path(), args); r)
+            return r.value();
+    }
+
     if (!override_package.empty())
     {
         auto s = sw::load(override_package[1]);
@@ -300,6 +323,12 @@ SUBCOMMAND_DECL(build)
     sw::build(build_arg);
 }
 
+SUBCOMMAND_DECL(worker)
+{
+    // commands come from the network, so listen on trusted interfaces only
+    runWorker(worker_address, (int)getExecutor().numberOfThreads());
+}
+
 #include <solution.h>
 
 SUBCOMMAND_DECL(ide)
@@ -328,6 +357,34 @@ SUBCOMMAND_DECL(ide)
     }
 }
 
+SUBCOMMAND_DECL(daemon)
+{
+    sw::Build::resident_plans = true;
+    runDaemon(fs::current_path(), [](const Strings &args)
+    {
+        // options keep values of the previous request otherwise
+        cl::ResetAllOptionOccurrences();
+        cl::ParseCommandLineOptions(args);
+        use_daemon = false; // we are the daemon
+        if (!subcommand_build && !subcommand_ide)
+            throw std::runtime_error("Only build and ide commands are served by the daemon");
+        setup_options();
+        // records are kept from the previous request
+        sw::refreshChangedFiles();
+        return sw_main(args);
+    });
+}
+
+SUBCOMMAND_DECL(watch)
+{
+    single_process_job(fs::current_path(), []()
+    {
+        auto s = sw::load(watch_arg);
+        auto &b = *((sw::Build*)s.get());
+        b.watch();
+    });
+}
+
 SUBCOMMAND_DECL(init)
 {
     elevate();
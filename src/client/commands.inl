@@ -20,9 +20,12 @@ self-upgrade - upgrade the client. implement via upgrade?
 */
 
 SUBCOMMAND(build, "Build files, dirs or packages") COMMA
+SUBCOMMAND(daemon, "Serve build and ide commands of this workspace from a resident process.") COMMA
 SUBCOMMAND(ide, "Used to invoke sw application to do IDE tasks: generate project files, clean, rebuild etc.") COMMA
 SUBCOMMAND(init, "Used to do some system setup which may require administrator access.") COMMA
 SUBCOMMAND(uri, "Used to invoke sw application from the website.") COMMA
+SUBCOMMAND(watch, "Build and then rebuild on file changes.") COMMA
+SUBCOMMAND(worker, "Execute commands sent by remote builds.") COMMA
 
 #ifdef SW_COMMA_SELF
 #undef COMMA
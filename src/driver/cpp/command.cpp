@@ -10,6 +10,8 @@
 #include "jumppad.h"
 #include "solution.h"
 
+#include <depfile.h>
+
 #include <boost/algorithm/string.hpp>
 #include <boost/dll.hpp>
 
@@ -75,6 +77,20 @@ path Command::getProgram() const
     return p;
 }
 
+uint64_t Command::getDefaultEstimatedTime() const
+{
+    // rough numbers, real ones are taken from the previous runs
+    if (!base)
+        return Base::getDefaultEstimatedTime();
+    if (base->as<VisualStudioLibrarian>() || base->as<GNULibrarian>())
+        return 300;
+    if (base->as<Linker>())
+        return 2000;
+    if (base->as<Compiler>())
+        return 1000;
+    return Base::getDefaultEstimatedTime();
+}
+
 void Command::setProgram(const std::shared_ptr<Dependency> &d)
 {
     dependency = d;
@@ -100,16 +116,52 @@ void Command::addLazyAction(LazyAction f)
     actions.push_back(f);
 }
 
-void VSCommand::postProcess(bool)
+void VSCommand::processLine(std::string_view line)
 {
     // filter out includes and file name
-    static const auto pattern = "Note: including file:"s;
+    static const std::string_view pattern = "Note: including file:";
+
+    if (first_line)
+    {
+        first_line = false;
+        return;
+    }
+    if (line.compare(0, pattern.size(), pattern) != 0)
+    {
+        filtered_output += line;
+        filtered_output += "\n";
+        return;
+    }
+    auto include = String(line.substr(pattern.size()));
+    boost::trim(include);
+    includes.insert(std::move(include));
+}
 
-    std::deque<String> lines;
-    boost::split(lines, out.text, boost::is_any_of("\n"));
-    out.text.clear();
-    // remove filename
-    lines.pop_front();
+void VSCommand::processOutput(String &buf, bool eof)
+{
+    size_t start = 0;
+    for (auto p = buf.find('\n'); p != buf.npos; p = buf.find('\n', start))
+    {
+        processLine(std::string_view(buf).substr(start, p - start));
+        start = p + 1;
+    }
+    if (eof)
+    {
+        processLine(std::string_view(buf).substr(start));
+        buf.swap(filtered_output);
+        filtered_output.clear();
+        output_processed = true;
+        return;
+    }
+    // incomplete line stays
+    buf.erase(0, start);
+}
+
+void VSCommand::postProcess(bool)
+{
+    // output was captured as a whole
+    if (!output_processed)
+        processOutput(out.text, true);
 
     //file.clearImplicitDependencies();
 
@@ -118,22 +170,17 @@ void VSCommand::postProcess(bool)
     for (auto &f : outputs)
         File(f, *fs).clearImplicitDependencies();*/
 
-    for (auto &line : lines)
-    {
-        auto p = line.find(pattern);
-        if (p != 0)
-        {
-            out.text += line + "\n";
-            continue;
-        }
-        auto include = line.substr(pattern.size());
-        boost::trim(include);
-        //file.addImplicitDependency(include);
-        for (auto &f : intermediate)
-            File(f, *fs).addImplicitDependency(include);
-        for (auto &f : outputs)
-            File(f, *fs).addImplicitDependency(include);
-    }
+    std::vector<std::string_view> files(includes.begin(), includes.end());
+    auto deps = getFileDependencies(*fs, files);
+    for (auto &f : intermediate)
+        File(f, *fs).addImplicitDependencies(deps);
+    for (auto &f : outputs)
+        File(f, *fs).addImplicitDependencies(deps);
+
+    // next run starts over
+    includes.clear();
+    first_line = true;
+    output_processed = false;
 }
 
 void GNUCommand::postProcess(bool ok)
@@ -143,31 +190,17 @@ void GNUCommand::postProcess(bool ok)
     if (!fs::exists(deps_file))
         return;
 
-    static const std::regex space_r("[^\\\\] ");
+    // reused between commands of this thread
+    thread_local String buf;
+    thread_local std::vector<std::string_view> files;
+    parseDepfile(read_file(deps_file), buf, files);
 
-    auto lines = read_lines(deps_file);
-    //file.clearImplicitDependencies();
-    for (auto i = lines.begin() + 1; i != lines.end(); i++)
-    {
-        auto &s = *i;
-        s.resize(s.size() - 1);
-        boost::trim(s);
-        s = std::regex_replace(s, space_r, "\n");
-        boost::replace_all(s, "\\ ", " ");
-        Strings files;
-        boost::split(files, s, boost::is_any_of("\n"));
-        //boost::replace_all(s, "\\\"", "\""); // probably no quotes
-        //for (auto &f : files)
-            //file.addImplicitDependency(f);
-
-        for (auto &f2 : files)
-        {
-            for (auto &f : intermediate)
-                File(f, *fs).addImplicitDependency(f2);
-            for (auto &f : outputs)
-                File(f, *fs).addImplicitDependency(f2);
-        }
-    }
+    // headers are resolved once for all outputs
+    auto deps = getFileDependencies(*fs, files);
+    for (auto &f : intermediate)
+        File(f, *fs).addImplicitDependencies(deps);
+    for (auto &f : outputs)
+        File(f, *fs).addImplicitDependencies(deps);
 }
 
 ///
@@ -338,6 +371,12 @@ CommandBuilder &operator<<(CommandBuilder &cb, const ::sw::cmd::tag_env &t)
     return cb;
 }
 
+CommandBuilder &operator<<(CommandBuilder &cb, const ::sw::cmd::tag_resource &t)
+{
+    cb.c->addResource(t.name, t.weight);
+    return cb;
+}
+
 CommandBuilder &operator<<(CommandBuilder &cb, const Command::LazyCallback &t)
 {
     if (!cb.stopped)
@@ -63,6 +63,7 @@ struct tag_stdin : detail::tag_io_file {};
 struct tag_stdout : detail::tag_io_file {};
 struct tag_stderr : detail::tag_io_file {};
 struct tag_env { String k, v; };
+struct tag_resource { String name; int weight; };
 struct tag_end {};
 
 struct tag_dep : detail::tag_targets
@@ -258,6 +259,12 @@ inline tag_env env(const String &k, const String &v)
     return d;
 }
 
+// see sw::getResourcePool()
+inline tag_resource resource(const String &name, int weight = 1)
+{
+    return { name, weight };
+}
+
 } // namespace cmd
 
 namespace driver::cpp
@@ -277,6 +284,7 @@ struct SW_DRIVER_CPP_API Command : ::sw::builder::Command
 
     path getProgram() const override;
     void prepare() override;
+    uint64_t getDefaultEstimatedTime() const override;
 
     using Base::setProgram;
     void setProgram(const std::shared_ptr<Dependency> &d);
@@ -299,6 +307,7 @@ struct SW_DRIVER_CPP_API ExecuteBuiltinCommand : builder::Command
     virtual ~ExecuteBuiltinCommand() = default;
 
     void execute() override;
+    uint64_t getDefaultEstimatedTime() const override { return 10; }
     //path getProgram() const override { return "ExecuteBuiltinCommand"; };
 
     //template <class T>
@@ -324,6 +333,17 @@ struct VSCommand : Command
     //File file;
 
     void postProcess(bool ok) override;
+    void processOutput(String &buf, bool eof) override;
+    bool isDistributable() const override { return true; }
+
+private:
+    // /showIncludes of the current run, output is filtered as it arrives
+    std::unordered_set<String> includes;
+    String filtered_output;
+    bool first_line = true;
+    bool output_processed = false;
+
+    void processLine(std::string_view line);
 };
 
 struct GNUCommand : Command
@@ -332,6 +352,8 @@ struct GNUCommand : Command
     path deps_file;
 
     void postProcess(bool ok) override;
+    bool isDistributable() const override { return true; }
+    Files getSideOutputs() const override { return { deps_file }; }
 };
 
 struct CommandBuilder
@@ -365,6 +387,7 @@ DECLARE_STREAM_OP(::sw::cmd::tag_wdir);
 DECLARE_STREAM_OP(::sw::cmd::tag_end);
 DECLARE_STREAM_OP(::sw::cmd::tag_dep);
 DECLARE_STREAM_OP(::sw::cmd::tag_env);
+DECLARE_STREAM_OP(::sw::cmd::tag_resource);
 DECLARE_STREAM_OP(Command::LazyCallback);
 
 /*template <class T>
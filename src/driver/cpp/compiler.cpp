@@ -34,6 +34,15 @@ static cl::opt<bool> do_not_resolve_compiler("do-not-resolve-compiler");
 namespace sw
 {
 
+// links are the most memory hungry commands, so they are limited separately
+static void addLinkResources(builder::Command &c, const String &lto_flag)
+{
+    c.addResource("link");
+    c.addResource("memory", 0);
+    if (std::any_of(c.args.begin(), c.args.end(), [&lto_flag](const auto &a) { return boost::istarts_with(a, lto_flag); }))
+        c.addResource("lto");
+}
+
 std::string getVsToolset(VisualStudioVersion v)
 {
     switch (v)
@@ -1442,6 +1451,7 @@ std::shared_ptr<Program> VisualStudioLinker::clone() const
 void VisualStudioLinker::getAdditionalOptions(driver::cpp::Command *c) const
 {
     getCommandLineOptions<VisualStudioLinkerOptions>(c, *this);
+    addLinkResources(*c, "/LTCG");
 }
 
 void VisualStudioLinker::setInputLibraryDependencies(const FilesOrdered &files)
@@ -1565,6 +1575,7 @@ std::shared_ptr<builder::Command> GNULinker::getCommand() const
     getCommandLineOptions<GNULinkerOptions>(c.get(), *this);
     iterate([c](auto &v, auto &gs) { v.addEverything(*c); });
     //getAdditionalOptions(c.get());
+    addLinkResources(*c, "-flto");
 
     return cmd = c;
 }
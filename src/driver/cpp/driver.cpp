@@ -86,6 +86,9 @@ bool CppDriver::execute(const path &file_or_dir) const
         return {};
     current_thread_path(f.value().parent_path());
 
+    if (auto r = Build::executeSavedPlan(f.value()); r)
+        return r.value();
+
     if (auto s = load(f.value()); s)
         return s->execute();
     return false;
@@ -7,12 +7,17 @@
 #include <solution.h>
 
 #include "checks_storage.h"
+#include "command_cache.h"
+#include "distributed.h"
 #include "file_storage.h"
 #include "functions.h"
 #include "generator/generator.h"
+#include "include_scanner.h"
 #include "inserts.h"
+#include "mapped_file.h"
 #include "program.h"
 #include "resolver.h"
+#include "watch.h"
 
 #include <directories.h>
 #include <hash.h>
@@ -54,6 +59,7 @@ static cl::opt<String> configuration("configuration", cl::desc("Set build config
 static cl::opt<String> platform("platform", cl::desc("Set build platform")/*, cl::sub(subcommand_ide)*/);
 //static cl::opt<String> arch("arch", cl::desc("Set arch")/*, cl::sub(subcommand_ide)*/);
 static cl::opt<bool> static_build("static-build", cl::desc("Set static build")/*, cl::sub(subcommand_ide)*/);
+static cl::opt<bool> no_plan_cache("no-plan-cache", cl::desc("Do not use saved execution plan when configuration is not changed"));
 
 namespace sw
 {
@@ -540,18 +546,106 @@ void Solution::execute() const
     execute(p);
 }
 
+// programs, inputs, outputs and their deps
+static std::unordered_set<FileRecord *> gatherFiles(const ExecutionPlan<builder::Command> &p)
+{
+    std::unordered_set<FileRecord *> files;
+    auto add = [&files](FileRecord &r)
+    {
+        if (!files.insert(&r).second)
+            return;
+        for (auto &[f, d] : r.explicit_dependencies)
+        {
+            if (d)
+                files.insert(d);
+        }
+        for (auto &[f, d] : r.implicit_dependencies)
+        {
+            if (d)
+                files.insert(d);
+        }
+    };
+    for (auto &c : p.commands)
+    {
+        if (!c->program.empty())
+            add(File(c->program, *c->fs).getFileRecord());
+        for (auto &i : c->inputs)
+            add(File(i, *c->fs).getFileRecord());
+        for (auto &o : c->outputs)
+            add(File(o, *c->fs).getFileRecord());
+    }
+    return files;
+}
+
+static void executePlan(ExecutionPlan<builder::Command> &p, bool silent)
+{
+    for (auto &c : p.commands)
+        c->silent = silent;
+
+    size_t current_command = 1;
+    size_t total_commands = 0;
+    for (auto &c : p.commands)
+    {
+        if (!c->outputs.empty())
+            total_commands++;
+    }
+
+    for (auto &c : p.commands)
+    {
+        c->total_commands = total_commands;
+        c->current_command = &current_command;
+    }
+
+    ScopedTime t;
+
+    //Executor e(1);
+    auto &e = getExecutor();
+
+    // stat all files at once, outdated checks take results from memory
+    auto files = gatherFiles(p);
+    statFiles(files);
+    // next watch cycle or daemon request must go to disk
+    SCOPE_EXIT
+    {
+        discardStats(files);
+    };
+
+    // hash sources at once too
+    if (useContentHashes())
+    {
+        auto sources = files;
+        for (auto i = sources.begin(); i != sources.end();)
+        {
+            if ((*i)->isGenerated())
+                i = sources.erase(i);
+            else
+                ++i;
+        }
+        updateHashes(sources);
+    }
+
+    if (CommandCache::isEnabled())
+        getCommandCache().prefetch(p.commands);
+
+    auto d = getDispatcher();
+    p.execute(e, d ? d->getJobs() : 0, Build::local_jobs);
+    if (!silent)
+        LOG_INFO(logger, "Build time: " << t.getTimeFloat() << " s.");
+}
+
 void Solution::execute(ExecutionPlan<builder::Command> &p) const
 {
     auto print_graph = [](const auto &ep, const path &p, bool short_names = false)
     {
         String s;
         s += "digraph G {\n";
-        for (auto &c : ep.commands)
+        for (size_t i = 0; i < ep.commands.size(); i++)
         {
+            auto &c = ep.commands[i];
             {
                 s += c->getName(short_names) + ";\n";
-                for (auto &d : c->dependencies)
-                    s += c->getName(short_names) + " -> " + d->getName(short_names) + ";\n";
+                for (auto d : ep.dependencies[i])
+                    s += c->getName(short_names) + " -> " + ep.commands[d]->getName(short_names) + ";\n";
             }
             /*s += "{";
             s += "rank = same;";
@@ -687,23 +781,6 @@ void Solution::execute(ExecutionPlan<builder::Command> &p) const
         write_file(p, t + s);
     };
 
-    for (auto &c : p.commands)
-        c->silent = silent;
-
-    size_t current_command = 1;
-    size_t total_commands = 0;
-    for (auto &c : p.commands)
-    {
-        if (!c->outputs.empty())
-            total_commands++;
-    }
-
-    for (auto &c : p.commands)
-    {
-        c->total_commands = total_commands;
-        c->current_command = &current_command;
-    }
-
     // execute early to prevent commands expansion into response files
     // print misc
     if (::print_commands && !silent) // && !b console mode
@@ -718,17 +795,8 @@ void Solution::execute(ExecutionPlan<builder::Command> &p) const
         print_numbers(p, d / "numbers.txt");
     }
 
-    ScopedTime t;
-
-    //Executor e(1);
-    auto &e = getExecutor();
-
     if (!dry_run)
-    {
-        p.execute(e);
-        if (!silent)
-            LOG_INFO(logger, "Build time: " << t.getTimeFloat() << " s.");
-    }
+        executePlan(p, silent);
 }
 
 void Solution::prepare()
@@ -1092,6 +1160,9 @@ void Build::prepare()
     //performChecks();
     ScopedTime t;
 
+    // sources could change since the previous build of this process
+    getIncludeScanner().clear();
+
     auto &e = getExecutor();
     std::vector<Future<void>> fs;
     for (auto &s : solutions)
@@ -1484,6 +1555,8 @@ path Build::build(const path &fn)
     Build b;
     auto r = b.build_configs_separate({ fn });
     dll = r.begin()->second;
+    config = fn;
+    config_fs = b.solutions[0].fs;
     if (File(dll, *b.solutions[0].fs).isChanged())
     {
         do_not_rebuild_config = false;
@@ -1500,235 +1573,611 @@ void Build::build_and_load(const path &fn)
     load(dll);
 }
 
-ExecutionPlan<builder::Command> load(const path &fn, const Solution &s)
-{
-    BinaryContext ctx;
-    ctx.load(fn);
+// execution plan file
+// all sections are arrays of plain structs, so the file is used right from memory mapping
+
+static const uint32_t plan_magic = 0x50455753; // SWEP
+static const uint32_t plan_version = 2;
+
+struct PlanHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t key;
+    uint32_t n_files;
+    uint32_t n_commands;
+    uint32_t n_edges;
+    uint32_t n_refs;
+    uint32_t n_strings;
+    uint32_t strings_size;
+    uint32_t unused;
+};
+
+// plan is stale when any of these files changes
+struct PlanFile
+{
+    uint32_t name;
+    uint32_t unused;
+    int64_t last_write_time; // -1 when file does not exist
+};
+
+enum class PlanCommandType : uint32_t
+{
+    Command,
+    DriverCommand,
+    VSCommand,
+    GNUCommand,
+    ExecuteBuiltinCommand,
+};
+
+enum PlanCommandFlags : uint32_t
+{
+    pcfUseResponseFiles         = 1 << 0,
+    pcfRemoveOutputs            = 1 << 1,
+    pcfProtectArgsWithQuotes    = 1 << 2,
+    pcfAlways                   = 1 << 3,
+};
+
+// strings are ids in the string table,
+// lists are [begin, begin + n) ranges in refs,
+// resources are (pool name, weight) pairs there
+struct PlanCommand
+{
+    uint64_t critical_path;
+    PlanCommandType type;
+    uint32_t flags;
+    int32_t maybe_unused;
+    uint32_t config;
+    uint32_t name;
+    uint32_t name_short;
+    uint32_t program;
+    uint32_t working_directory;
+    uint32_t in;
+    uint32_t out;
+    uint32_t err;
+    uint32_t deps_file;
+    uint32_t args, n_args;
+    uint32_t environment, n_environment;
+    uint32_t inputs, n_inputs;
+    uint32_t intermediate, n_intermediate;
+    uint32_t outputs, n_outputs;
+    uint32_t resources, n_resources;
+};
+
+static int64_t get_last_write_time(const path &p)
+{
+    error_code ec;
+    auto t = fs::last_write_time(p, ec);
+    if (ec)
+        return -1;
+    return t.time_since_epoch().count();
+}
+
+// returns false if plan contains commands we cannot restore
+static bool savePlan(const path &fn, const ExecutionPlan<builder::Command> &p, const String &key, const Files &files)
+{
+    StringHashMap<uint32_t> ids;
+    Strings strings;
+    auto add_string = [&ids, &strings](const String &s)
+    {
+        auto [i, inserted] = ids.emplace(s, (uint32_t)strings.size());
+        if (inserted)
+            strings.push_back(s);
+        return i->second;
+    };
+    add_string({});
 
-    size_t sz;
-    ctx.read(sz);
+    std::vector<uint32_t> refs;
+    auto add_strings = [&refs, &add_string](const auto &v, uint32_t &begin, uint32_t &n)
+    {
+        begin = (uint32_t)refs.size();
+        for (auto &s : v)
+        {
+            if constexpr (std::is_same_v<std::decay_t<decltype(s)>, path>)
+                refs.push_back(add_string(s.u8string()));
+            else
+                refs.push_back(add_string(s));
+        }
+        n = (uint32_t)refs.size() - begin;
+    };
 
-    size_t n_strings;
-    ctx.read(n_strings);
+    PlanHeader h = {};
+    h.magic = plan_magic;
+    h.version = plan_version;
+    h.key = add_string(key);
 
-    Strings strings(1);
-    while (n_strings--)
+    std::vector<PlanFile> pfiles;
+    for (auto &f : files)
     {
-        String s;
-        ctx.read(s);
-        strings.push_back(s);
+        PlanFile pf = {};
+        pf.name = add_string(f.u8string());
+        pf.last_write_time = get_last_write_time(f);
+        pfiles.push_back(pf);
     }
 
-    auto read_string = [&strings, &ctx, &sz]() -> String
+    std::vector<PlanCommand> commands;
+    for (auto &c : p.commands)
     {
-        int n = 0;
-        ctx._read(&n, sz);
-        return strings[n];
-    };
+        if (c->as<_ExecuteCommand>())
+            return false;
+
+        PlanCommand pc = {};
+        pc.critical_path = c->critical_path;
+        pc.type = PlanCommandType::Command;
+        if (auto c2 = c->as<driver::cpp::VSCommand>(); c2)
+            pc.type = PlanCommandType::VSCommand;
+        else if (auto c2 = c->as<driver::cpp::GNUCommand>(); c2)
+        {
+            pc.type = PlanCommandType::GNUCommand;
+            pc.deps_file = add_string(c2->deps_file.u8string());
+        }
+        else if (auto c2 = c->as<driver::cpp::ExecuteBuiltinCommand>(); c2)
+            pc.type = PlanCommandType::ExecuteBuiltinCommand;
+        else if (auto c2 = c->as<driver::cpp::Command>(); c2)
+            pc.type = PlanCommandType::DriverCommand;
+
+        if (c->use_response_files)
+            pc.flags |= pcfUseResponseFiles;
+        if (c->remove_outputs_before_execution)
+            pc.flags |= pcfRemoveOutputs;
+        if (c->protect_args_with_quotes)
+            pc.flags |= pcfProtectArgsWithQuotes;
+        if (c->always)
+            pc.flags |= pcfAlways;
+        pc.maybe_unused = c->maybe_unused;
+
+        pc.config = add_string(c->fs->config);
+        pc.name = add_string(c->name);
+        pc.name_short = add_string(c->name_short);
+        pc.program = add_string(c->program.u8string());
+        pc.working_directory = add_string(c->working_directory.u8string());
+        pc.in = add_string(c->in.file.u8string());
+        pc.out = add_string(c->out.file.u8string());
+        pc.err = add_string(c->err.file.u8string());
+
+        add_strings(c->args, pc.args, pc.n_args);
+        Strings env;
+        for (auto &[k, v] : c->environment)
+        {
+            env.push_back(k);
+            env.push_back(v);
+        }
+        add_strings(env, pc.environment, pc.n_environment);
+        add_strings(c->inputs, pc.inputs, pc.n_inputs);
+        add_strings(c->intermediate, pc.intermediate, pc.n_intermediate);
+        add_strings(c->outputs, pc.outputs, pc.n_outputs);
+
+        pc.resources = (uint32_t)refs.size();
+        for (auto &[pool, weight] : c->getResources())
+        {
+            refs.push_back(add_string(pool));
+            refs.push_back((uint32_t)weight);
+        }
+        pc.n_resources = (uint32_t)refs.size() - pc.resources;
+
+        commands.push_back(pc);
+    }
 
-    std::map<size_t, std::shared_ptr<builder::Command>> commands;
+    std::vector<uint32_t> string_offsets;
+    String blob;
+    for (auto &s : strings)
+    {
+        string_offsets.push_back((uint32_t)blob.size());
+        blob += s;
+    }
+    string_offsets.push_back((uint32_t)blob.size());
+
+    h.n_files = (uint32_t)pfiles.size();
+    h.n_commands = (uint32_t)commands.size();
+    h.n_edges = (uint32_t)p.dependencies.ids.size();
+    h.n_refs = (uint32_t)refs.size();
+    h.n_strings = (uint32_t)strings.size();
+    h.strings_size = (uint32_t)blob.size();
 
-    auto add_command = [&commands, &s, &read_string](size_t id, uint8_t type)
+    String out;
+    auto append = [&out](const auto &v)
     {
-        auto it = commands.find(id);
-        if (it == commands.end())
+        out.append((const char *)v.data(), v.size() * sizeof(v[0]));
+    };
+    out.append((const char *)&h, sizeof(h));
+    append(pfiles);
+    append(commands);
+    append(p.dependencies.offsets);
+    append(p.dependencies.ids);
+    append(refs);
+    append(string_offsets);
+    out += blob;
+
+    // readers must never see partially written file
+    fs::create_directories(fn.parent_path());
+    auto tmp = fn;
+    tmp += ".tmp";
+    write_file(tmp, out);
+    fs::rename(tmp, fn);
+    return true;
+}
+
+// returns nothing when plan is stale or broken
+static optional<ExecutionPlan<builder::Command>> loadPlan(const path &fn, const String &key)
+{
+    try
+    {
+        MappedFile m(fn);
+        auto b = m.data();
+        auto e = m.data() + m.size();
+
+        auto section = [&b, &e](auto *&ptr, size_t n)
         {
-            std::shared_ptr<builder::Command> c;
-            switch (type)
-            {
-            case 1:
+            auto sz = n * sizeof(*ptr);
+            if ((size_t)(e - b) < sz)
+                throw std::runtime_error("unexpected end of file");
+            ptr = (std::remove_reference_t<decltype(ptr)>)b;
+            b += sz;
+        };
+
+        const PlanHeader *h;
+        section(h, 1);
+        if (h->magic != plan_magic || h->version != plan_version)
+            return {};
+
+        const PlanFile *files;
+        const PlanCommand *pcommands;
+        const uint32_t *deps_offsets, *deps_ids, *refs, *string_offsets;
+        const char *blob;
+        section(files, h->n_files);
+        section(pcommands, h->n_commands);
+        section(deps_offsets, (size_t)h->n_commands + 1);
+        section(deps_ids, h->n_edges);
+        section(refs, h->n_refs);
+        section(string_offsets, (size_t)h->n_strings + 1);
+        section(blob, h->strings_size);
+
+        // once, so every string below is inside the blob
+        if (string_offsets[0] != 0 || string_offsets[h->n_strings] != h->strings_size ||
+            !std::is_sorted(string_offsets, string_offsets + (size_t)h->n_strings + 1))
+            throw std::runtime_error("bad string table");
+        if (std::any_of(files, files + h->n_files, [h](auto &f) { return f.name >= h->n_strings; }))
+            throw std::runtime_error("bad file name");
+        // command string ids are checked on every use
+        auto get_string = [h, string_offsets, blob](uint32_t i)
+        {
+            if (i >= h->n_strings)
+                throw std::runtime_error("bad string id");
+            return String(blob + string_offsets[i], string_offsets[i + 1] - string_offsets[i]);
+        };
+        auto get_refs = [h, refs](uint32_t begin, uint32_t n)
+        {
+            if (begin > h->n_refs || n > h->n_refs - begin)
+                throw std::runtime_error("bad list");
+            return refs + begin;
+        };
+
+        if (get_string(h->key) != key)
+            return {};
+
+        // parallel stat pass over validation files
+        std::atomic_bool changed = false;
+        {
+            auto &e = getExecutor();
+            const size_t batch = 64;
+            Futures<void> futures;
+            for (size_t i = 0; i < h->n_files; i += batch)
             {
-                auto c2 = std::make_shared<driver::cpp::VSCommand>();
-                //c2->file.fs = s.fs;
-                c = c2;
-                //c2->file.file = read_string();
+                futures.push_back(e.push([&, i]
+                {
+                    for (size_t j = i; j < std::min<size_t>(i + batch, h->n_files) && !changed; j++)
+                    {
+                        if (get_last_write_time(get_string(files[j].name)) != files[j].last_write_time)
+                            changed = true;
+                    }
+                }));
             }
+            waitAndGet(futures);
+        }
+        if (changed)
+            return {};
+
+        std::vector<std::shared_ptr<builder::Command>> commands;
+        commands.reserve(h->n_commands);
+        for (size_t i = 0; i < h->n_commands; i++)
+        {
+            auto &pc = pcommands[i];
+
+            std::shared_ptr<builder::Command> c;
+            switch (pc.type)
+            {
+            case PlanCommandType::DriverCommand:
+                c = std::make_shared<driver::cpp::Command>();
                 break;
-            case 2:
+            case PlanCommandType::VSCommand:
+                c = std::make_shared<driver::cpp::VSCommand>();
+                break;
+            case PlanCommandType::GNUCommand:
             {
                 auto c2 = std::make_shared<driver::cpp::GNUCommand>();
-                //c2->file.fs = s.fs;
-                c = c2;
-                //c2->file.file = read_string();
-                c2->deps_file = read_string();
-            }
-            case 3:
-            {
-                auto c2 = std::make_shared<driver::cpp::ExecuteBuiltinCommand>();
+                c2->deps_file = get_string(pc.deps_file);
                 c = c2;
             }
                 break;
+            case PlanCommandType::ExecuteBuiltinCommand:
+                c = std::make_shared<driver::cpp::ExecuteBuiltinCommand>();
+                break;
             default:
                 c = std::make_shared<builder::Command>();
                 break;
             }
-            commands[id] = c;
-            c->fs = s.fs;
-            return c;
+
+            c->fs = &getFileStorage(get_string(pc.config));
+            c->critical_path = pc.critical_path;
+            c->use_response_files = pc.flags & pcfUseResponseFiles;
+            c->remove_outputs_before_execution = pc.flags & pcfRemoveOutputs;
+            c->protect_args_with_quotes = pc.flags & pcfProtectArgsWithQuotes;
+            c->always = pc.flags & pcfAlways;
+            c->maybe_unused = pc.maybe_unused;
+
+            c->name = get_string(pc.name);
+            c->name_short = get_string(pc.name_short);
+            c->program = get_string(pc.program);
+            c->working_directory = get_string(pc.working_directory);
+
+            auto r = get_refs(pc.args, pc.n_args);
+            for (size_t j = 0; j < pc.n_args; j++)
+                c->args.push_back(get_string(r[j]));
+
+            r = get_refs(pc.environment, pc.n_environment);
+            for (size_t j = 0; j + 1 < pc.n_environment; j += 2)
+                c->environment[get_string(r[j])] = get_string(r[j + 1]);
+
+            if (auto f = get_string(pc.in); !f.empty())
+                c->redirectStdin(f);
+            if (auto f = get_string(pc.out); !f.empty())
+                c->redirectStdout(f);
+            if (auto f = get_string(pc.err); !f.empty())
+                c->redirectStderr(f);
+
+            r = get_refs(pc.inputs, pc.n_inputs);
+            for (size_t j = 0; j < pc.n_inputs; j++)
+                c->addInput(path(get_string(r[j])));
+
+            r = get_refs(pc.intermediate, pc.n_intermediate);
+            for (size_t j = 0; j < pc.n_intermediate; j++)
+                c->addIntermediate(path(get_string(r[j])));
+
+            r = get_refs(pc.outputs, pc.n_outputs);
+            for (size_t j = 0; j < pc.n_outputs; j++)
+                c->addOutput(path(get_string(r[j])));
+
+            r = get_refs(pc.resources, pc.n_resources);
+            for (size_t j = 0; j + 1 < pc.n_resources; j += 2)
+                c->addResource(get_string(r[j]), (int)r[j + 1]);
+
+            commands.push_back(c);
         }
-        return it->second;
-    };
 
-    std::unordered_map<builder::Command *, std::vector<size_t>> deps;
-    while (!ctx.eof())
+        ExecutionPlan<builder::Command>::Edges deps;
+        deps.offsets.assign(deps_offsets, deps_offsets + (size_t)h->n_commands + 1);
+        deps.ids.assign(deps_ids, deps_ids + h->n_edges);
+        if (deps.offsets[0] != 0 || deps.offsets.back() != h->n_edges ||
+            !std::is_sorted(deps.offsets.begin(), deps.offsets.end()) ||
+            std::any_of(deps.ids.begin(), deps.ids.end(), [h](auto id) { return id >= h->n_commands; }))
+            throw std::runtime_error("bad graph");
+
+        return ExecutionPlan<builder::Command>::createExecutionPlan(std::move(commands), std::move(deps));
+    }
+    catch (std::exception &e)
     {
-        size_t id;
-        ctx.read(id);
+        LOG_DEBUG(logger, "Cannot load execution plan " << fn.u8string() << ": " << e.what());
+    }
+    return {};
+}
 
-        uint8_t type = 0;
-        ctx.read(type);
+static String getPlanKey(const path &config)
+{
+    String s;
+    s += std::to_string(plan_version) + "\n";
+    s += normalize_path(fs::absolute(config)) + "\n";
+    s += boost::dll::program_location().string() + "\n";
+    s += configuration.getValue() + "\n";
+    s += platform.getValue() + "\n";
+    s += compiler.getValue() + "\n";
+    s += target_os.getValue() + "\n";
+    s += static_build ? "static\n" : "\n";
+    s += debug_configs ? "debug_configs\n" : "\n";
+    return s;
+}
 
-        auto c = add_command(id, type);
+static path getPlanFilename(const path &config)
+{
+    return config.parent_path() / ".sw" / "plans" / (sha256_short(getPlanKey(config)) + ".swplan");
+}
 
-        c->name = read_string();
+namespace
+{
+
+struct ResidentPlan
+{
+    struct Entry
+    {
+        path p;
+        int64_t last_write_time;
+        // for regular files, touched but unchanged config does not drop the plan
+        String hash;
+    };
 
-        c->program = read_string();
-        c->working_directory = read_string();
+    std::vector<Entry> files;
+    ExecutionPlan<builder::Command> p;
+};
 
-        size_t n;
-        ctx.read(n);
-        while (n--)
-            c->args.push_back(read_string());
+}
 
-        c->redirectStdin(read_string());
-        c->redirectStdout(read_string());
-        c->redirectStderr(read_string());
+// by plan key
+static std::unordered_map<String, ResidentPlan> plans_in_memory;
 
-        ctx.read(n);
-        while (n--)
-        {
-            auto k = read_string();
-            c->environment[k] = read_string();
-        }
+bool Build::resident_plans = false;
+size_t Build::local_jobs = 0;
 
-        ctx.read(n);
-        while (n--)
+static optional<bool> executeResidentPlan(const path &config)
+{
+    auto i = plans_in_memory.find(getPlanKey(config));
+    if (i == plans_in_memory.end())
+        return {};
+    auto &rp = i->second;
+    for (auto &f : rp.files)
+    {
+        auto t = get_last_write_time(f.p);
+        if (t == f.last_write_time)
+            continue;
+        if (!f.hash.empty() && getContentHash(f.p) == f.hash)
         {
-            ctx.read(id);
-            deps[c.get()].push_back(id);
+            f.last_write_time = t;
+            continue;
         }
-
-        ctx.read(n);
-        while (n--)
-            c->addInput(read_string());
-
-        ctx.read(n);
-        while (n--)
-            c->addIntermediate(read_string());
-
-        ctx.read(n);
-        while (n--)
-            c->addOutput(read_string());
+        plans_in_memory.erase(i);
+        return {};
     }
 
-    for (auto &[c, dep] : deps)
+    // changed files are known from the file monitor (see refreshChangedFiles())
+    for (auto &c : rp.p.commands)
+        c->resetExecution();
+
+    try
     {
-        for (auto &d : dep)
-            c->dependencies.insert(commands[d]);
+        executePlan(rp.p, false);
+        return true;
     }
-
-    Commands commands2;
-    for (auto &[_, c] : commands)
-        commands2.insert(c);
-    return ExecutionPlan<builder::Command>::createExecutionPlan(commands2);
+    catch (std::exception &e) { LOG_ERROR(logger, "error during build: " << e.what()); }
+    catch (...) {}
+    return false;
 }
 
-void save(const path &fn, const ExecutionPlan<builder::Command> &p)
+optional<bool> Build::executeSavedPlan(const path &config)
 {
-    BinaryContext ctx;
+    if (no_plan_cache || ::dry_run || print_commands || !generator.empty())
+        return {};
 
-    auto strings = p.gatherStrings();
+    // first request loads the config, so its plan becomes resident
+    if (resident_plans)
+        return executeResidentPlan(config);
 
-    size_t sz;
-    if (strings.size() & 0xff000000)
-        sz = 4;
-    else if (strings.size() & 0xff0000)
-        sz = 3;
-    else if (strings.size() & 0xff00)
-        sz = 2;
-    else if (strings.size() & 0xff)
-        sz = 1;
+    auto fn = getPlanFilename(config);
+    if (!fs::exists(fn))
+        return {};
 
-    ctx.write(sz);
+    ScopedTime t;
+    auto p = loadPlan(fn, getPlanKey(config));
+    if (!p)
+        return {};
+    LOG_DEBUG(logger, "Execution plan is loaded in " << t.getTimeFloat() << " s.");
 
-    ctx.write(strings.size());
-    std::map<int, String> strings2;
-    for (auto &[s, n] : strings)
-        strings2[n] = s;
-    for (auto &[_, s] : strings2)
-        ctx.write(s);
+    try
+    {
+        executePlan(*p, false);
+        return true;
+    }
+    catch (std::exception &e) { LOG_ERROR(logger, "error during build: " << e.what()); }
+    catch (...) {}
+    return false;
+}
+
+void Build::saveExecutionPlan(const ExecutionPlan<builder::Command> &p) const
+{
+    if (config.empty() || no_plan_cache || dry_run)
+        return;
+
+    Files files;
+    files.insert(config);
+    files.insert(boost::dll::program_location().string());
 
-    auto print_string = [&strings, &ctx, &sz](const String &in)
+    // config dll with everything it was built from
+    if (config_fs && !dll.empty())
     {
-        auto n = strings[in];
-        ctx._write(&n, sz);
-    };
+        std::unordered_set<FileRecord *> visited;
+        std::function<void(FileRecord *)> add_deps = [&files, &visited, &add_deps](FileRecord *r)
+        {
+            if (!r || !visited.insert(r).second)
+                return;
+            if (!r->file.empty())
+                files.insert(r->file);
+            for (auto &[f, d] : r->explicit_dependencies)
+                add_deps(d);
+            for (auto &[f, d] : r->implicit_dependencies)
+                add_deps(d);
+        };
+        add_deps(&File(dll, *config_fs).getFileRecord());
+    }
 
+    // source lists: added or removed files change mtime of their directories,
+    // skip directories we write into
+    Files out_dirs;
     for (auto &c : p.commands)
     {
-        ctx.write(c.get());
+        for (auto &f : c->outputs)
+            out_dirs.insert(f.parent_path());
+        for (auto &f : c->intermediate)
+            out_dirs.insert(f.parent_path());
+    }
 
-        uint8_t type = 0;
-        if (auto c2 = c->as<driver::cpp::VSCommand>(); c2)
-        {
-            type = 1;
-            ctx.write(type);
-            //print_string(c2->file.file.u8string());
-        }
-        else if (auto c2 = c->as<driver::cpp::GNUCommand>(); c2)
-        {
-            type = 2;
-            ctx.write(type);
-            //print_string(c2->file.file.u8string());
-            print_string(c2->deps_file.u8string());
-        }
-        else if (auto c2 = c->as<driver::cpp::ExecuteBuiltinCommand>(); c2)
+    // recursive globs may pick up files from new subdirectories,
+    // so every directory up to the source root is checked
+    Files roots;
+    for (auto &s : solutions)
+    {
+        roots.insert(s.SourceDir.lexically_normal());
+        for (auto &[pkg, t] : s.children)
+            roots.insert(t->SourceDir.lexically_normal());
+    }
+    for (auto &c : p.commands)
+    {
+        for (auto &f : c->inputs)
         {
-            type = 3;
-            ctx.write(type);
+            auto d = f.parent_path();
+            if (out_dirs.find(d) != out_dirs.end())
+                continue;
+            Files dirs;
+            bool rooted = false;
+            for (auto d2 = d.lexically_normal(); !d2.empty(); d2 = d2.parent_path())
+            {
+                if (files.find(d2) != files.end())
+                {
+                    // the rest is there already
+                    rooted = true;
+                    break;
+                }
+                if (out_dirs.find(d2) == out_dirs.end())
+                    dirs.insert(d2);
+                if (roots.find(d2) != roots.end())
+                {
+                    rooted = true;
+                    break;
+                }
+                if (d2 == d2.parent_path())
+                    break;
+            }
+            // not a project file, its directory only
+            if (!rooted)
+                dirs = { d };
+            files.insert(dirs.begin(), dirs.end());
         }
-        else
-            ctx.write(type);
-
-        print_string(c->getName());
-
-        print_string(c->program.u8string());
-        print_string(c->working_directory.u8string());
-
-        ctx.write(c->args.size());
-        for (auto &a : c->args)
-            print_string(a);
+    }
 
-        print_string(c->in.file.u8string());
-        print_string(c->out.file.u8string());
-        print_string(c->err.file.u8string());
+    auto fn = getPlanFilename(config);
+    if (!savePlan(fn, p, getPlanKey(config), files))
+    {
+        error_code ec;
+        fs::remove(fn, ec);
+    }
 
-        ctx.write(c->environment.size());
-        for (auto &[k, v] : c->environment)
+    if (resident_plans)
+    {
+        auto &rp = plans_in_memory[getPlanKey(config)];
+        rp.files.clear();
+        for (auto &f : files)
         {
-            print_string(k);
-            print_string(v);
+            error_code ec;
+            rp.files.push_back({ f, get_last_write_time(f), fs::is_regular_file(f, ec) ? getContentHash(f) : String() });
         }
-
-        ctx.write(c->dependencies.size());
-        for (auto &d : c->dependencies)
-            ctx.write(d.get());
-
-        ctx.write(c->inputs.size());
-        for (auto &f : c->inputs)
-            print_string(f.u8string());
-
-        ctx.write(c->intermediate.size());
-        for (auto &f : c->intermediate)
-            print_string(f.u8string());
-
-        ctx.write(c->outputs.size());
-        for (auto &f : c->outputs)
-            print_string(f.u8string());
+        rp.p = ExecutionPlan<builder::Command>::createExecutionPlan(p.commands, p.dependencies);
     }
-
-    fs::create_directories(fn.parent_path());
-    ctx.save(fn);
 }
 
 bool Build::execute()
@@ -1749,8 +2198,15 @@ bool Build::execute()
                 // prevent double assign generators
                 fs->reset();
 
-                auto p = ::sw::load(fn, s);
-                s.execute(p);
+                auto p = loadPlan(fn, {});
+                if (!p)
+                {
+                    // old or broken plan, will be written again
+                    error_code ec;
+                    fs::remove(fn, ec);
+                    continue;
+                }
+                s.execute(*p);
                 return true;
             }
         }
@@ -1779,11 +2235,13 @@ bool Build::execute()
                 auto p = s.getExecutionPlan();
                 auto fn = s.getExecutionPlanFilename();
                 if (!fs::exists(fn))
-                    save(fn, p);
+                    savePlan(fn, p, {}, {});
             }
         }
 
-        Solution::execute();
+        auto p = getExecutionPlan();
+        Solution::execute(p);
+        saveExecutionPlan(p);
         return true;
     }
     catch (std::exception &e) { LOG_ERROR(logger, "error during build: " << e.what()); }
@@ -1791,6 +2249,40 @@ bool Build::execute()
     return false;
 }
 
+void Build::watch()
+{
+    dry_run = ::dry_run;
+
+    prepare();
+    for (auto &[n, _] : TargetsToBuild)
+    {
+        for (auto &s : solutions)
+        {
+            auto &t = s.children[n];
+            if (!t)
+                throw std::runtime_error("Empty target");
+            s.TargetsToBuild[n] = t;
+        }
+    }
+
+    auto p = getExecutionPlan();
+    try
+    {
+        Solution::execute(p);
+    }
+    catch (std::exception &e)
+    {
+        // keep watching, failed commands are still outdated
+        LOG_ERROR(logger, "error during build: " << e.what());
+    }
+    saveExecutionPlan(p);
+
+    sw::watch(p, [this](auto &sp)
+    {
+        Solution::execute(sp);
+    });
+}
+
 void Build::build_and_run(const path &fn)
 {
     build_and_load(fn);
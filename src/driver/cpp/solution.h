@@ -137,6 +137,20 @@ struct SW_DRIVER_CPP_API Build : Solution, PackageScript
     void build_package(const String &pkg);
     void load(const path &dll);
     bool execute() override;
+    // builds once, then rebuilds affected commands on file changes
+    void watch();
+
+    // no-op builds: runs saved plan without loading the config,
+    // returns nothing when there is no valid plan
+    static optional<bool> executeSavedPlan(const path &config);
+
+    // long-running process (sw daemon): saved plans also stay in memory
+    // and are executed again while their files are not changed
+    static bool resident_plans;
+
+    // max commands running locally at once, 0 - executor size;
+    // sw daemon can not resize its executor for -j of a request
+    static size_t local_jobs;
 
     void performChecks() override;
     void prepare() override;
@@ -152,8 +166,11 @@ protected:
 
 private:
     path dll;
+    path config;
+    FileStorage *config_fs = nullptr;
 
     void setSettings();
+    void saveExecutionPlan(const ExecutionPlan<builder::Command> &p) const;
     void findCompiler();
     SharedLibraryTarget &createTarget(const Files &files);
 
@@ -16,11 +16,13 @@
 #include <suffix.h>
 
 #include <directories.h>
+#include <include_scanner.h>
 #include <package_data.h>
 
 #include <boost/algorithm/string.hpp>
 #include <nlohmann/json.hpp>
 #include <primitives/constants.h>
+#include <primitives/executor.h>
 #include <primitives/sw/settings.h>
 
 #include <primitives/log.h>
@@ -34,6 +36,7 @@ DECLARE_STATIC_LOGGER(logger, "target");
     (BinaryDir / CPPAN_FILE_PREFIX ".symbols.def")
 
 static cl::opt<bool> do_not_mangle_object_names("do-not-mangle-object-names");
+static cl::opt<bool> scan_includes("scan-includes", cl::desc("Sources wait only for generators of files they include"), cl::init(true));
 
 void createDefFile(const path &def, const Files &obj_files)
 #if defined(CPPAN_OS_WINDOWS)
@@ -1173,6 +1176,14 @@ std::shared_ptr<builder::Command> NativeExecutedTarget::getCommand() const
 Commands NativeExecutedTarget::getGeneratedCommands() const
 {
     Commands generated;
+    for (auto &[f, c] : getGeneratedFiles())
+        generated.insert(c);
+    return generated;
+}
+
+std::unordered_map<path, std::shared_ptr<builder::Command>> NativeExecutedTarget::getGeneratedFiles() const
+{
+    std::unordered_map<path, std::shared_ptr<builder::Command>> generated;
 
     const path def = NATIVE_TARGET_DEF_SYMBOLS_FILE;
 
@@ -1184,13 +1195,101 @@ Commands NativeExecutedTarget::getGeneratedCommands() const
             continue;
         if (f.first == def)
             continue;
-        auto c = p.getFileRecord().getGenerator();
-        generated.insert(c);
+        generated[f.first.lexically_normal()] = p.getFileRecord().getGenerator();
     }
 
     return generated;
 }
 
+using SourceCommands = std::vector<std::pair<NativeSourceFile *, std::shared_ptr<builder::Command>>>;
+
+static FilesOrdered getForcedIncludeFiles(const NativeCompiler &c)
+{
+    if (auto c2 = c.as<VisualStudioCompiler>())
+        return c2->ForcedIncludeFiles();
+    if (auto c2 = c.as<ClangClCompiler>())
+        return c2->ForcedIncludeFiles();
+    if (auto c2 = c.as<ClangCompiler>())
+        return c2->ForcedIncludeFiles();
+    if (auto c2 = c.as<GNUCompiler>())
+        return c2->ForcedIncludeFiles();
+    return {};
+}
+
+// when includes of a source are not known for sure, they are taken from
+// the previous build, without it the source waits for all generators
+static void addGeneratedDependencies(FileStorage &fs, const SourceCommands &sources,
+    const std::unordered_map<path, std::shared_ptr<builder::Command>> &generated_files, const Commands &generated)
+{
+    Files gen;
+    for (auto &[p, _] : generated_files)
+        gen.insert(p);
+
+    auto &e = getExecutor();
+    std::vector<Future<void>> futures;
+    for (auto &[f, c] : sources)
+    {
+        futures.push_back(e.push([&fs, &gen, &generated_files, &generated, f = f, c = c]
+        {
+            FilesOrdered idirs;
+            for (auto &d : f->compiler->gatherIncludeDirectories())
+                idirs.push_back(d.lexically_normal());
+            for (auto &d : f->compiler->System.gatherIncludeDirectories())
+                idirs.push_back(d.lexically_normal());
+
+            FilesOrdered forced;
+            for (auto &fi : getForcedIncludeFiles(*f->compiler))
+                forced.push_back(fi.lexically_normal());
+
+            auto r = getIncludeScanner().scan(f->file, forced, idirs, gen);
+            for (auto &i : r.includes)
+            {
+                if (auto g = generated_files.find(i); g != generated_files.end())
+                    c->dependencies.insert(g->second);
+            }
+            if (!r.complete)
+            {
+                // includes of generated files are known only after they are generated,
+                // compiler reported them on the previous build, full barrier is for the first one
+                bool learned = false;
+                for (auto &o : c->outputs)
+                {
+                    for (auto &[_, d] : File(o, fs).getFileRecord().implicit_dependencies)
+                    {
+                        if (!d)
+                            continue;
+                        learned = true;
+                        if (auto g = generated_files.find(d->file.lexically_normal()); g != generated_files.end())
+                            c->dependencies.insert(g->second);
+                    }
+                }
+                if (!learned)
+                    c->dependencies.insert(generated.begin(), generated.end());
+                return;
+            }
+
+            // first build, compiler did not tell us real includes yet
+            std::vector<std::string_view> includes;
+            Strings storage;
+            // views must stay valid
+            storage.reserve(r.includes.size());
+            for (auto &i : r.includes)
+            {
+                storage.push_back(i.string());
+                includes.push_back(storage.back());
+            }
+            auto deps = getFileDependencies(fs, includes);
+            for (auto &o : c->outputs)
+            {
+                File of(o, fs);
+                if (of.getFileRecord().implicit_dependencies.empty())
+                    of.addImplicitDependencies(deps);
+            }
+        }, sources.size()));
+    }
+    waitAndGet(futures);
+}
+
 Commands NativeExecutedTarget::getCommands() const
 {
     Commands cmds;
@@ -1233,6 +1332,7 @@ Commands NativeExecutedTarget::getCommands() const
     }
 
     // this source files
+    SourceCommands sources;
     {
         auto sd = normalize_path(SourceDir);
         auto bd = normalize_path(BinaryDir);
@@ -1270,12 +1370,59 @@ Commands NativeExecutedTarget::getCommands() const
                 }
             }
             cmds.insert(c);
+            sources.emplace_back(f, c);
         }
     }
 
+    auto get_tgts = [this]()
+    {
+        TargetsSet deps;
+        for (auto &d : Dependencies)
+        {
+            if (d->target.lock().get() == this)
+                continue;
+            if (d->Dummy)
+                continue;
+
+            if (d->IncludeDirectoriesOnly && !d->GenerateCommandsBefore)
+                continue;
+            deps.insert(d->target.lock().get());
+        }
+        return deps;
+    };
+
+    // generated files of dependent targets
+    std::unordered_map<path, std::shared_ptr<builder::Command>> dep_generated_files;
+    Commands dep_generated;
+    if (getCommand())
+    {
+        for (auto &l : get_tgts())
+        {
+            auto g = ((NativeExecutedTarget*)l)->getGeneratedFiles();
+            dep_generated_files.insert(g.begin(), g.end());
+        }
+        for (auto &[_, c] : dep_generated_files)
+            dep_generated.insert(c);
+    }
+
     // add generated files
-    for (auto &cmd : cmds)
-        cmd->dependencies.insert(generated.begin(), generated.end());
+    // sources wait only for generators of files they include
+    Commands scanned;
+    if (scan_includes && (!generated.empty() || !dep_generated.empty()))
+    {
+        auto generated_files = getGeneratedFiles();
+        generated_files.insert(dep_generated_files.begin(), dep_generated_files.end());
+        auto all = generated;
+        all.insert(dep_generated.begin(), dep_generated.end());
+        addGeneratedDependencies(*getSolution()->fs, sources, generated_files, all);
+        for (auto &[_, c] : sources)
+            scanned.insert(c);
+    }
+    else
+    {
+        for (auto &cmd : cmds)
+            cmd->dependencies.insert(generated.begin(), generated.end());
+    }
     cmds.insert(generated.begin(), generated.end());
 
     //LOG_DEBUG(logger, "Building target: " + pkg.ppath.toString());
@@ -1298,31 +1445,12 @@ Commands NativeExecutedTarget::getCommands() const
             cmds.insert(g);
         }
 
-        auto get_tgts = [this]()
+        // add dependencies on generated commands from dependent targets,
+        // scanned sources already have the ones they need
+        for (auto &c1 : cmds)
         {
-            TargetsSet deps;
-            for (auto &d : Dependencies)
-            {
-                if (d->target.lock().get() == this)
-                    continue;
-                if (d->Dummy)
-                    continue;
-
-                if (d->IncludeDirectoriesOnly && !d->GenerateCommandsBefore)
-                    continue;
-                deps.insert(d->target.lock().get());
-            }
-            return deps;
-        };
-
-        // add dependencies on generated commands from dependent targets
-        for (auto &l : get_tgts())
-        {
-            for (auto &c2 : ((NativeExecutedTarget*)l)->getGeneratedCommands())
-            {
-                for (auto &c : cmds)
-                    c->dependencies.insert(c2);
-            }
+            if (scanned.find(c1) == scanned.end())
+                c1->dependencies.insert(dep_generated.begin(), dep_generated.end());
         }
 
         // link deps
@@ -776,6 +776,8 @@ private:
     void autoDetectOptions();
     path getOutputFileName(const path &root) const;
     Commands getGeneratedCommands() const;
+    // lexically normal paths
+    std::unordered_map<path, std::shared_ptr<builder::Command>> getGeneratedFiles() const;
 };
 
 /**
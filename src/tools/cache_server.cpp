@@ -0,0 +1,226 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// reference server for the remote command cache (see src/builder/remote_cache.h)
+// stores blobs in a plain directory, good enough for tests and small teams
+
+#include <primitives/filesystem.h>
+#include <primitives/sw/main.h>
+#include <primitives/sw/settings.h>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/asio.hpp>
+
+#include <condition_variable>
+#include <mutex>
+#include <regex>
+#include <sstream>
+#include <thread>
+
+#include <primitives/log.h>
+DECLARE_STATIC_LOGGER(logger, "cache_server");
+
+using boost::asio::ip::tcp;
+
+static cl::opt<path> storage_dir("d", cl::desc("Storage directory"), cl::init(path("cache")));
+static cl::opt<int> port("p", cl::desc("Port to listen on"), cl::init(8089));
+// anyone who reaches the server can put blobs, so it is local by default
+static cl::opt<String> bind_address("a", cl::desc("Address to listen on"), cl::init("127.0.0.1"));
+static cl::opt<int> max_connections("c", cl::desc("Maximum number of connections"), cl::init(64));
+
+static const size_t max_blob_size = 1024 * 1024 * 1024;
+// bodies are streamed from and to files with this buffer
+static const size_t chunk_size = 1024 * 1024;
+
+static std::mutex connections_m;
+static std::condition_variable connections_cv;
+static int connections;
+
+static void reply(tcp::socket &s, const String &status, const String &body = {})
+{
+    String r = "HTTP/1.1 " + status + "\r\n";
+    r += "Content-Length: " + std::to_string(body.size()) + "\r\n";
+    r += "\r\n";
+    boost::asio::write(s, boost::asio::buffer(r));
+    if (!body.empty())
+        boost::asio::write(s, boost::asio::buffer(body));
+}
+
+static void replyFile(tcp::socket &s, const path &fn)
+{
+    ScopedFile f(fn, "rb");
+    auto size = fs::file_size(fn);
+    String r = "HTTP/1.1 200 OK\r\n";
+    r += "Content-Length: " + std::to_string(size) + "\r\n";
+    r += "\r\n";
+    boost::asio::write(s, boost::asio::buffer(r));
+
+    std::vector<char> chunk(chunk_size);
+    while (size)
+    {
+        auto n = fread(chunk.data(), 1, std::min<uintmax_t>(size, chunk.size()), f.getHandle());
+        if (n == 0)
+            throw std::runtime_error("Cannot read " + fn.u8string());
+        boost::asio::write(s, boost::asio::buffer(chunk.data(), n));
+        size -= n;
+    }
+}
+
+// body goes to f if it is set and is dropped otherwise
+static void readBody(tcp::socket &s, boost::asio::streambuf &buf, size_t n, FILE *f)
+{
+    // read together with the header
+    auto k = std::min(n, buf.size());
+    String head(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_begin(buf.data()) + k);
+    buf.consume(k);
+    if (f && k)
+        fwrite(head.data(), k, 1, f);
+    n -= k;
+
+    std::vector<char> chunk(std::min(n, chunk_size));
+    while (n)
+    {
+        auto r = s.read_some(boost::asio::buffer(chunk.data(), std::min(n, chunk.size())));
+        if (f)
+            fwrite(chunk.data(), r, 1, f);
+        n -= r;
+    }
+}
+
+static void session(tcp::socket s)
+{
+    static const std::regex target_r("/cas/([mo])/([0-9a-zA-Z]{2,})");
+
+    try
+    {
+        boost::asio::streambuf buf;
+        while (1)
+        {
+            auto n = boost::asio::read_until(s, buf, "\r\n\r\n");
+            String header(boost::asio::buffers_begin(buf.data()), boost::asio::buffers_begin(buf.data()) + n);
+            buf.consume(n);
+
+            std::istringstream ss(header);
+            String method, target, line;
+            ss >> method >> target;
+            std::getline(ss, line);
+
+            size_t content_length = 0;
+            bool expect_continue = false;
+            bool close = false;
+            while (std::getline(ss, line))
+            {
+                auto p = line.find(':');
+                if (p == line.npos)
+                    continue;
+                auto k = boost::to_lower_copy(boost::trim_copy(line.substr(0, p)));
+                auto v = boost::to_lower_copy(boost::trim_copy(line.substr(p + 1)));
+                if (k == "content-length")
+                    content_length = std::stoull(v);
+                else if (k == "expect")
+                    expect_continue = v == "100-continue";
+                else if (k == "connection")
+                    close = v == "close";
+            }
+
+            if (content_length > max_blob_size)
+            {
+                // with 100-continue the client does not send the body until we ask
+                if (!expect_continue)
+                    readBody(s, buf, content_length, nullptr);
+                reply(s, "413 Payload Too Large");
+                if (close)
+                    return;
+                continue;
+            }
+
+            // curl asks before sending big bodies
+            if (expect_continue)
+                boost::asio::write(s, boost::asio::buffer(String("HTTP/1.1 100 Continue\r\n\r\n")));
+
+            std::smatch m;
+            if (!std::regex_match(target, m, target_r))
+            {
+                readBody(s, buf, content_length, nullptr);
+                reply(s, "400 Bad Request");
+            }
+            else
+            {
+                auto key = m[2].str();
+                auto fn = storage_dir / m[1].str() / key.substr(0, 2) / key;
+                if (method == "GET")
+                {
+                    readBody(s, buf, content_length, nullptr);
+                    if (fs::exists(fn))
+                        replyFile(s, fn);
+                    else
+                        reply(s, "404 Not Found");
+                }
+                else if (method == "PUT")
+                {
+                    fs::create_directories(fn.parent_path());
+                    auto tmp = fn.parent_path() / ("tmp." + unique_path().u8string());
+                    try
+                    {
+                        {
+                            ScopedFile f(tmp, "wb");
+                            readBody(s, buf, content_length, f.getHandle());
+                        }
+                        fs::rename(tmp, fn);
+                    }
+                    catch (...)
+                    {
+                        error_code ec;
+                        fs::remove(tmp, ec);
+                        throw;
+                    }
+                    reply(s, "200 OK");
+                }
+                else
+                {
+                    readBody(s, buf, content_length, nullptr);
+                    reply(s, "405 Method Not Allowed");
+                }
+            }
+
+            if (close)
+                return;
+        }
+    }
+    catch (std::exception &e)
+    {
+        // disconnects end up here too
+        LOG_TRACE(logger, e.what());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    cl::ParseCommandLineOptions(argc, argv);
+
+    boost::asio::io_context ctx;
+    tcp::acceptor a(ctx, tcp::endpoint(boost::asio::ip::make_address(bind_address), (unsigned short)port));
+    LOG_INFO(logger, "Listening on " << bind_address << ":" << port << ", storage dir: " << storage_dir.u8string());
+    while (1)
+    {
+        {
+            std::unique_lock lk(connections_m);
+            connections_cv.wait(lk, [] { return connections < max_connections; });
+            connections++;
+        }
+        tcp::socket s(ctx);
+        a.accept(s);
+        std::thread([s = std::move(s)]() mutable
+        {
+            session(std::move(s));
+            {
+                std::unique_lock lk(connections_m);
+                connections--;
+            }
+            connections_cv.notify_one();
+        }).detach();
+    }
+}
@@ -74,6 +74,10 @@ void build(Solution &s)
     builder -= "src/builder/db_sqlite.*"_rr;
     builder.Public += manager, "org.sw.demo.preshing.junction-master"_dep,
         "pub.egorpugin.primitives.context-master"_dep;
+    builder +=
+        "org.sw.demo.badger.curl.libcurl-7"_dep,
+        "org.sw.demo.boost.asio-1"_dep,
+        "org.sw.demo.Cyan4973.xxHash-*"_dep;
 
     auto &cpp_driver = p.addTarget<LibraryTarget>("driver.cpp");
     cpp_driver.ApiName = "SW_DRIVER_CPP_API";
@@ -126,6 +130,15 @@ void build(Solution &s)
         d->Dummy = true;
     }
 
+    auto &cache_server = tools.addTarget<ExecutableTarget>("cache_server");
+    cache_server.CPPVersion = CPPLanguageStandard::CPP17;
+    cache_server += "src/tools/cache_server.cpp";
+    cache_server +=
+        "pub.egorpugin.primitives.filesystem-master"_dep,
+        "pub.egorpugin.primitives.log-master"_dep,
+        "pub.egorpugin.primitives.sw.main-master"_dep,
+        "org.sw.demo.boost.asio-1"_dep;
+
     auto &client = p.addTarget<ExecutableTarget>("client");
     client += "src/client/.*"_rr;
     client += "src/client"_idir;
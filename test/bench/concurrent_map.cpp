@@ -0,0 +1,109 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// concurrent inserts like files db load: heap allocations per value
+
+#include <concurrent_map.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+static std::atomic<int64_t> allocations;
+
+void *operator new(size_t n)
+{
+    allocations++;
+    if (auto p = malloc(n))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// arena chunks
+void *operator new(size_t n, std::align_val_t a)
+{
+    allocations++;
+    auto al = std::max(sizeof(void *), (size_t)a);
+#ifdef _WIN32
+    if (auto p = _aligned_malloc(n, al))
+        return p;
+#else
+    if (auto p = aligned_alloc(al, (n + al - 1) / al * al))
+        return p;
+#endif
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p, std::align_val_t) noexcept
+{
+#ifdef _WIN32
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+void operator delete(void *p, size_t, std::align_val_t a) noexcept
+{
+    operator delete(p, a);
+}
+
+// about the size of file records
+struct Value
+{
+    int64_t lwt = 0;
+    int64_t size = 0;
+    void *data = nullptr;
+    void *fs = nullptr;
+    char payload[160];
+};
+
+int main(int argc, char **argv)
+{
+    size_t n = 500'000;
+    if (argc > 1)
+        n = std::stoull(argv[1]);
+    auto nt = std::max(1u, std::thread::hardware_concurrency());
+
+    ConcurrentMapSimple<Value> m;
+    auto before = allocations.load();
+    auto t = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < nt; i++)
+    {
+        threads.emplace_back([&m, n, nt, i]
+        {
+            for (size_t k = i; k < n; k += nt)
+                m.insert(k + 1);
+        });
+    }
+    for (auto &th : threads)
+        th.join();
+    auto time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+
+    auto s = m.getArenaStats();
+    std::cout << nt << " threads, " << s.values << " values in " << s.chunks << " chunks ("
+        << s.bytes / 1024 / 1024 << " MB), "
+        << allocations.load() - before << " heap allocations, " << time << " s" << std::endl;
+    return 0;
+}
@@ -0,0 +1,93 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// depfile of a boost/qt heavy translation unit: line based regex splitting
+// (as before) vs single pass parser
+
+#include <depfile.h>
+
+#include <boost/algorithm/string.hpp>
+
+#include <chrono>
+#include <iostream>
+#include <regex>
+
+using namespace sw;
+
+// as gcc writes it
+static String make_depfile(size_t n)
+{
+    String s = "/home/user/project/build/obj/main.cpp.o: /home/user/project/src/main.cpp";
+    for (size_t i = 0; i < n; i++)
+    {
+        s += " \\\n ";
+        if (i % 3 == 0)
+            s += "/usr/include/boost/fusion/container/vector/detail/preprocessed/vector" + std::to_string(i) + ".hpp";
+        else if (i % 3 == 1)
+            s += "/usr/include/x86_64-linux-gnu/qt5/QtCore/qabstract_item" + std::to_string(i) + ".h";
+        else
+            s += "/usr/include/c++/8/bits/stl_algo" + std::to_string(i) + ".h";
+    }
+    s += "\n";
+    return s;
+}
+
+// previous implementation
+static size_t parse_regex(const String &d)
+{
+    static const std::regex space_r("[^\\\\] ");
+
+    Strings lines;
+    boost::split(lines, d, boost::is_any_of("\n"));
+    size_t n = 0;
+    for (auto i = lines.begin() + 1; i != lines.end(); i++)
+    {
+        auto &s = *i;
+        if (s.empty())
+            continue;
+        s.resize(s.size() - 1);
+        boost::trim(s);
+        s = std::regex_replace(s, space_r, "\n");
+        boost::replace_all(s, "\\ ", " ");
+        Strings files;
+        boost::split(files, s, boost::is_any_of("\n"));
+        n += files.size();
+    }
+    return n;
+}
+
+template <class F>
+static void run(const char *name, int iterations, F &&f)
+{
+    size_t n = 0;
+    auto t = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; i++)
+        n += f();
+    auto time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+    std::cout << name << ": " << time / iterations * 1e6 << " us per depfile (" << n / iterations << " deps)" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = 2000;
+    if (argc > 1)
+        n = std::stoull(argv[1]);
+    const int iterations = 200;
+
+    auto d = make_depfile(n);
+    std::cout << n << " headers, " << d.size() / 1024 << " KB" << std::endl;
+
+    run("regex", iterations, [&d] { return parse_regex(d); });
+
+    String buf;
+    std::vector<std::string_view> deps;
+    run("parser", iterations, [&]
+    {
+        parseDepfile(d, buf, deps);
+        return deps.size();
+    });
+    return 0;
+}
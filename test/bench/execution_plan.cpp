@@ -0,0 +1,83 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// plan creation and scheduling overhead on synthetic graphs
+
+#include <execution_plan.h>
+
+#include <primitives/executor.h>
+
+#include <chrono>
+#include <iostream>
+#include <random>
+
+using namespace sw;
+
+struct BenchCommand : CommandData<BenchCommand>
+{
+    void execute() override {}
+    void prepare() override {}
+};
+
+using BenchCommands = std::unordered_set<std::shared_ptr<BenchCommand>>;
+
+// looks like a usual build: many compile commands feeding fewer link commands,
+// links depend on other links
+static BenchCommands make_graph(size_t n)
+{
+    std::mt19937 g(n);
+    std::vector<std::shared_ptr<BenchCommand>> v(n);
+    for (auto &c : v)
+        c = std::make_shared<BenchCommand>();
+
+    const size_t objs_per_link = 20;
+    for (size_t i = objs_per_link; i < n; i += objs_per_link)
+    {
+        auto &l = v[i];
+        for (size_t j = i - objs_per_link + 1; j < i; j++)
+            l->dependencies.insert(v[j]);
+        // chain to the previous link makes the graph deep
+        l->dependencies.insert(v[i - objs_per_link]);
+        // and some random deps to earlier links
+        for (int k = 0; k < 3 && i > objs_per_link; k++)
+            l->dependencies.insert(v[std::uniform_int_distribution<size_t>(0, i / objs_per_link - 1)(g) * objs_per_link]);
+    }
+    return BenchCommands(v.begin(), v.end());
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point t)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+}
+
+int main(int argc, char **argv)
+{
+    std::vector<size_t> sizes{ 10'000, 100'000, 1'000'000 };
+    if (argc > 1)
+        sizes = { std::stoull(argv[1]) };
+
+    Executor e;
+    for (auto n : sizes)
+    {
+        auto cmds = make_graph(n);
+
+        auto t = std::chrono::steady_clock::now();
+        auto ep = ExecutionPlan<BenchCommand>::createExecutionPlan(cmds);
+        auto create = seconds_since(t);
+        if (!cmds.empty())
+        {
+            std::cerr << "unexpected cycle" << std::endl;
+            return 1;
+        }
+
+        t = std::chrono::steady_clock::now();
+        ep.execute(e);
+        auto execute = seconds_since(t);
+
+        std::cout << n << " commands: create " << create << " s, execute " << execute << " s" << std::endl;
+    }
+    return 0;
+}
@@ -0,0 +1,124 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// memory of file dependency maps on a synthetic project:
+// path keys (as before) vs interned path ids
+
+#include <path_interner.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <unordered_map>
+
+using namespace sw;
+
+// live heap bytes of the process
+static std::atomic<int64_t> allocated;
+
+void *operator new(size_t n)
+{
+    auto p = (size_t *)malloc(n + 16);
+    if (!p)
+        throw std::bad_alloc();
+    *p = n;
+    allocated += n;
+    return (char *)p + 16;
+}
+
+void operator delete(void *p) noexcept
+{
+    if (!p)
+        return;
+    auto b = (size_t *)((char *)p - 16);
+    allocated -= *b;
+    free(b);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+struct Project
+{
+    std::vector<path> sources;
+    std::vector<path> headers;
+    // header indices per source
+    std::vector<std::vector<uint32_t>> includes;
+};
+
+// every source includes ~100 headers from a shared pool, like a usual big tree
+static Project make_project(size_t n_sources)
+{
+    const size_t n_headers = n_sources / 5;
+    const size_t includes_per_source = 100;
+
+    std::mt19937 g(n_sources);
+    Project p;
+    for (size_t i = 0; i < n_headers; i++)
+        p.headers.push_back("/home/user/projects/big/include/library_" + std::to_string(i % 200) +
+            "/detail/internal/header_" + std::to_string(i) + ".h");
+    for (size_t i = 0; i < n_sources; i++)
+    {
+        p.sources.push_back("/home/user/projects/big/src/module_" + std::to_string(i % 500) +
+            "/implementation/source_" + std::to_string(i) + ".cpp");
+        std::vector<uint32_t> inc;
+        for (size_t j = 0; j < includes_per_source; j++)
+            inc.push_back(std::uniform_int_distribution<uint32_t>(0, (uint32_t)n_headers - 1)(g));
+        p.includes.push_back(std::move(inc));
+    }
+    return p;
+}
+
+template <class Key>
+struct Record
+{
+    path file;
+    std::unordered_map<Key, Record *> implicit_dependencies;
+};
+
+template <class Key, class F>
+static void run(const char *name, const Project &p, F &&key)
+{
+    auto before = allocated.load();
+    auto t = std::chrono::steady_clock::now();
+    {
+        std::vector<Record<Key>> headers(p.headers.size());
+        for (size_t i = 0; i < p.headers.size(); i++)
+            headers[i].file = p.headers[i];
+
+        std::vector<Record<Key>> sources(p.sources.size());
+        for (size_t i = 0; i < p.sources.size(); i++)
+        {
+            sources[i].file = p.sources[i];
+            for (auto h : p.includes[i])
+                sources[i].implicit_dependencies.emplace(key(p.headers[h]), &headers[h]);
+        }
+
+        auto used = allocated.load() - before;
+        auto time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+        std::cout << name << ": " << used / 1024 / 1024 << " MB, " << time << " s" << std::endl;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = 50'000;
+    if (argc > 1)
+        n = std::stoull(argv[1]);
+
+    auto p = make_project(n);
+    std::cout << n << " sources, " << p.headers.size() << " headers" << std::endl;
+
+    run<path>("path keys", p, [](const path &f) { return f; });
+    // interner memory is counted too, it lives until exit
+    run<PathId>("interned ids", p, [](const path &f) { return internPath(f); });
+    return 0;
+}
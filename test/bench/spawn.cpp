@@ -0,0 +1,45 @@
+// Copyright (C) 2018 Egor Pugin <egor.pugin@gmail.com>
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+// per spawn overhead: many `true` commands through builder::Command,
+// run with --fast-spawn=false to compare with primitives::Command
+
+#include <sw/builder/command.h>
+#include <file_storage.h>
+
+#include <primitives/sw/settings.h>
+
+#include <chrono>
+#include <iostream>
+
+using namespace sw;
+
+static cl::opt<int> n_commands(cl::Positional, cl::desc("<number of commands>"), cl::init(10000));
+
+int main(int argc, char **argv)
+{
+    cl::ParseCommandLineOptions(argc, argv);
+
+    auto &fs = getFileStorage("bench_spawn");
+    std::vector<std::shared_ptr<builder::Command>> cmds;
+    for (int i = 0; i < n_commands; i++)
+    {
+        auto c = std::make_shared<builder::Command>(fs);
+        c->program = "/bin/true";
+        // distinct hashes, so every command is new and outdated
+        c->args.push_back(std::to_string(i));
+        cmds.push_back(c);
+    }
+
+    auto t = std::chrono::steady_clock::now();
+    for (auto &c : cmds)
+        c->execute();
+    auto time = std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+
+    std::cout << n_commands << " commands: " << time << " s, "
+        << time / n_commands * 1e6 << " us per command" << std::endl;
+    return 0;
+}
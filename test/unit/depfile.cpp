@@ -0,0 +1,52 @@
+#include <depfile.h>
+
+#define CATCH_CONFIG_RUNNER
+#include <catch.hpp>
+
+using namespace sw;
+
+static Strings parse(const String &s)
+{
+    String buf;
+    std::vector<std::string_view> deps;
+    parseDepfile(s, buf, deps);
+    return Strings(deps.begin(), deps.end());
+}
+
+TEST_CASE("Checking depfile parser", "[depfile]")
+{
+    SECTION("Simple")
+    {
+        REQUIRE(parse("a.o: a.c a.h\n") == Strings{ "a.c", "a.h" });
+        REQUIRE(parse("a.o: a.c a.h") == Strings{ "a.c", "a.h" });
+        REQUIRE(parse("a.o:") == Strings{});
+        REQUIRE(parse("a.o b.o: a.c") == Strings{ "a.c" });
+    }
+
+    SECTION("Continuations")
+    {
+        REQUIRE(parse("a.o: a.c \\\n  a.h \\\n  b.h\n") == Strings{ "a.c", "a.h", "b.h" });
+        REQUIRE(parse("a.o: a.c \\\r\n  a.h\r\n") == Strings{ "a.c", "a.h" });
+        REQUIRE(parse("a.o: \\\n a.c\\\n b.h") == Strings{ "a.c", "b.h" });
+    }
+
+    SECTION("Escapes")
+    {
+        REQUIRE(parse("a.o: dir\\ with\\ spaces/a.h b\\#.h c$$.h") == Strings{ "dir with spaces/a.h", "b#.h", "c$.h" });
+        REQUIRE(parse("a.o: c:\\dir\\a.h") == Strings{ "c:\\dir\\a.h" });
+        REQUIRE(parse("c:\\dir\\a.o: c:\\dir\\a.c") == Strings{ "c:\\dir\\a.c" });
+    }
+
+    SECTION("Phony targets")
+    {
+        REQUIRE(parse("a.o: a.c a.h\n\na.h:\n\nb.h:\n") == Strings{ "a.c", "a.h" });
+        REQUIRE(parse("a.o: a.c # comment\n# a.h\n") == Strings{ "a.c" });
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Catch::Session().run(argc, argv);
+
+    return 0;
+}
@@ -0,0 +1,116 @@
+#include <distributed.h>
+#include <file_storage.h>
+
+#include <primitives/filesystem.h>
+
+#define CATCH_CONFIG_RUNNER
+#include <catch.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+using namespace sw;
+
+static path self;
+
+static std::shared_ptr<builder::Command> copyCommand(const path &in, const path &out)
+{
+    auto c = std::make_shared<builder::Command>(getFileStorage("test"));
+    c->setProgram(self);
+    c->args = { "copy", in.u8string(), out.u8string() };
+    c->addInput(in);
+    c->addOutput(out);
+    return c;
+}
+
+TEST_CASE("Checking distributed execution", "[distributed]")
+{
+    // workers run in this process and share the filesystem with the dispatcher
+    Strings workers{ "127.0.0.1:29501", "127.0.0.1:29502" };
+    static bool started = false;
+    if (!started)
+    {
+        for (auto &w : workers)
+            std::thread([w] { runWorker(w, 2); }).detach();
+        started = true;
+    }
+
+    std::unique_ptr<Dispatcher> d;
+    for (int i = 0; i < 100; i++)
+    {
+        d = std::make_unique<Dispatcher>(workers, 1);
+        if (d->getJobs() == 4)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    REQUIRE(d->getJobs() == 4);
+
+    auto dir = fs::temp_directory_path() / "sw_test_distributed" / unique_path();
+    fs::create_directories(dir);
+    write_file(dir / "in.txt", "input");
+
+    SECTION("Outputs")
+    {
+        std::vector<std::shared_ptr<builder::Command>> commands;
+        for (int i = 0; i < 8; i++)
+            commands.push_back(copyCommand(dir / "in.txt", dir / ("out" + std::to_string(i) + ".txt")));
+        std::vector<int> remote(commands.size());
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            threads.emplace_back([&d, &remote, &commands, i]
+            {
+                // busy workers refuse, then the command runs locally
+                remote[i] = d->execute(*commands[i]);
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+        REQUIRE(std::count(remote.begin(), remote.end(), 1) > 0);
+        for (size_t i = 0; i < commands.size(); i++)
+        {
+            if (remote[i])
+                REQUIRE(read_file(*commands[i]->outputs.begin()) == "input");
+        }
+    }
+
+    SECTION("Changed input")
+    {
+        auto c = copyCommand(dir / "in.txt", dir / "out.txt");
+        REQUIRE(d->execute(*c));
+        REQUIRE(read_file(dir / "out.txt") == "input");
+
+        write_file(dir / "in.txt", "changed");
+        c = copyCommand(dir / "in.txt", dir / "out.txt");
+        REQUIRE(d->execute(*c));
+        REQUIRE(read_file(dir / "out.txt") == "changed");
+    }
+
+    SECTION("Failure goes local")
+    {
+        auto c = copyCommand(dir / "missing.txt", dir / "out.txt");
+        REQUIRE_FALSE(d->execute(*c));
+        REQUIRE_FALSE(fs::exists(dir / "out.txt"));
+    }
+
+    error_code ec;
+    fs::remove_all(dir, ec);
+}
+
+int main(int argc, char **argv)
+{
+    // the program workers run
+    if (argc == 4 && argv[1] == String("copy"))
+    {
+        if (!fs::exists(argv[2]))
+            return 1;
+        write_file(argv[3], read_file(argv[2]));
+        return 0;
+    }
+
+    self = argv[0];
+    Catch::Session().run(argc, argv);
+
+    return 0;
+}
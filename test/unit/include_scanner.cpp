@@ -0,0 +1,90 @@
+#include <include_scanner.h>
+
+#define CATCH_CONFIG_RUNNER
+#include <catch.hpp>
+
+using namespace sw;
+
+// quoted ones are prefixed with "
+static Strings parse(const String &s, bool *computed = nullptr)
+{
+    auto p = IncludeScanner::parseIncludes(s);
+    if (computed)
+        *computed = p.computed;
+    Strings r;
+    for (auto &i : p.includes)
+        r.push_back((i.quoted ? "\"" : "") + i.name);
+    return r;
+}
+
+TEST_CASE("Checking include scanner", "[include_scanner]")
+{
+    SECTION("Simple")
+    {
+        REQUIRE(parse("#include <a.h>\n#include \"b.h\"\n") == Strings{ "a.h", "\"b.h" });
+        REQUIRE(parse("#include <a.h>") == Strings{ "a.h" });
+        REQUIRE(parse("  #  include<a.h>\n\t#\tinclude \"b.h\"") == Strings{ "a.h", "\"b.h" });
+        REQUIRE(parse("#include_next <a.h>\n#import \"b.h\"\n") == Strings{ "a.h", "\"b.h" });
+        REQUIRE(parse("#include <a.h>\r\n#include <b.h>\r\n") == Strings{ "a.h", "b.h" });
+        REQUIRE(parse("#define X\n#pragma once\nint x;\n") == Strings{});
+    }
+
+    SECTION("Not at line start")
+    {
+        REQUIRE(parse("int x; #include <a.h>\n") == Strings{});
+        REQUIRE(parse("x = 1 # include <a.h>\n") == Strings{});
+    }
+
+    SECTION("Comments")
+    {
+        REQUIRE(parse("// #include <a.h>\n#include <b.h>\n") == Strings{ "b.h" });
+        // comments are spaces
+        REQUIRE(parse("/* #include <a.h>\n#include <b.h>\n*/#include <c.h>\n") == Strings{ "c.h" });
+        REQUIRE(parse("/* x */ #include <a.h>\n") == Strings{ "a.h" });
+        REQUIRE(parse("#include <a.h> // <b.h>\n") == Strings{ "a.h" });
+        REQUIRE(parse("// comment \\\n#include <a.h>\n") == Strings{});
+    }
+
+    SECTION("Literals")
+    {
+        REQUIRE(parse("auto s = \"a\\\"#include <a.h>\";\n#include <b.h>\n") == Strings{ "b.h" });
+        REQUIRE(parse("auto s = \"unterminated\n#include <a.h>\n") == Strings{ "a.h" });
+        REQUIRE(parse("auto s = \"#include <a.h>\";\n") == Strings{});
+        REQUIRE(parse("auto s = R\"x(\n#include <a.h>\n)x\";\n#include <b.h>\n") == Strings{ "b.h" });
+        REQUIRE(parse("char c = '\"';\n#include <a.h>\n") == Strings{ "a.h" });
+        REQUIRE(parse("int i = 1'000;\n#include <a.h>\n") == Strings{ "a.h" });
+    }
+
+    SECTION("Continuations")
+    {
+        REQUIRE(parse("#inc\\\nlude <a.h>\n") == Strings{});
+        REQUIRE(parse("#\\\ninclude <a.h>\n") == Strings{ "a.h" });
+        REQUIRE(parse("#include \\\n<a.h>\n") == Strings{ "a.h" });
+    }
+
+    SECTION("If 0")
+    {
+        REQUIRE(parse("#if 0\n#include <a.h>\n#endif\n#include <b.h>\n") == Strings{ "b.h" });
+        REQUIRE(parse("  #  if 0 // off\n#include <a.h>\n#else\n#include <b.h>\n#endif\n") == Strings{ "b.h" });
+        REQUIRE(parse("#if 0\n#if 1\n#include <a.h>\n#endif\n#include <b.h>\n#elif 1\n#include <c.h>\n#endif\n") == Strings{ "c.h" });
+        REQUIRE(parse("#if 1\n#include <a.h>\n#else\n#include <b.h>\n#endif\n") == Strings{ "a.h", "b.h" });
+        REQUIRE(parse("#if 0\n#include <a.h>\n") == Strings{});
+    }
+
+    SECTION("Computed")
+    {
+        bool computed;
+        REQUIRE(parse("#include MY_HEADER\n#include <a.h>\n", &computed) == Strings{ "a.h" });
+        REQUIRE(computed);
+        REQUIRE(parse("#include <a.h>\n", &computed) == Strings{ "a.h" });
+        REQUIRE_FALSE(computed);
+        REQUIRE(parse("#include <a.h\n#include \"b.h\n") == Strings{});
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Catch::Session().run(argc, argv);
+
+    return 0;
+}
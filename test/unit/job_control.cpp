@@ -0,0 +1,127 @@
+#include <job_control.h>
+
+#include <sw/builder/command.h>
+#include <file_storage.h>
+
+#include <primitives/sw/settings.h>
+
+#define CATCH_CONFIG_RUNNER
+#include <catch.hpp>
+
+using namespace sw;
+
+TEST_CASE("Checking JobControl", "[job_control]")
+{
+    SystemPressure p;
+    p.memory_available = 4096;
+    p.cpus = 4;
+
+    JobControl jc([&p] { return p; });
+    jc.interval = std::chrono::milliseconds(0);
+    jc.memory_reserve = 1024;
+
+    SECTION("Memory")
+    {
+        REQUIRE(jc.tryStart(1000));
+        REQUIRE(jc.tryStart(1000));
+        // pending estimates are reset on every sample, provider shows real usage
+        p.memory_available = 2048;
+        REQUIRE_FALSE(jc.tryStart(1500));
+        REQUIRE(jc.tryStart(500));
+        // unknown estimate
+        p.memory_available = 1200;
+        REQUIRE_FALSE(jc.tryStart(0));
+        jc.memory_unknown = 100;
+        REQUIRE(jc.tryStart(0));
+    }
+
+    SECTION("Pending")
+    {
+        jc.interval = std::chrono::hours(1);
+        REQUIRE(jc.tryStart(1000));
+        REQUIRE(jc.tryStart(1000));
+        REQUIRE(jc.tryStart(1000));
+        // not seen by the system yet
+        REQUIRE_FALSE(jc.tryStart(1000));
+    }
+
+    SECTION("Stall")
+    {
+        p.memory_stall = 50;
+        REQUIRE(jc.tryStart(1));
+        REQUIRE_FALSE(jc.tryStart(1));
+        p.memory_stall = 1;
+        REQUIRE(jc.tryStart(1));
+    }
+
+    SECTION("Load")
+    {
+        // two cpus are busy with others
+        p.load = 2;
+        REQUIRE(jc.tryStart(1));
+        p.load = 3;
+        REQUIRE(jc.tryStart(1));
+        // others take three now
+        p.load = 5;
+        REQUIRE_FALSE(jc.tryStart(1));
+        jc.finish();
+        p.load = 4;
+        REQUIRE(jc.tryStart(1));
+    }
+
+    SECTION("Always one")
+    {
+        p.memory_available = 1;
+        p.memory_stall = 100;
+        p.load = 100;
+        REQUIRE(jc.tryStart(100000));
+        REQUIRE_FALSE(jc.tryStart(1));
+        jc.finish();
+        REQUIRE(jc.tryStart(100000));
+    }
+}
+
+static path self;
+
+// reports changes only once, like file records and command storage do
+struct OutdatedOnce : builder::Command
+{
+    mutable bool reported = false;
+
+    using builder::Command::Command;
+
+    bool isOutdated() const override
+    {
+        if (reported)
+            return false;
+        reported = true;
+        return true;
+    }
+};
+
+TEST_CASE("Checking outdated command with JobControl", "[job_control]")
+{
+    REQUIRE(getJobControl());
+
+    OutdatedOnce c(getFileStorage("test"));
+    c.setProgram(self);
+    c.args.push_back("--list-tests");
+    c.addResource("link");
+
+    REQUIRE(c.tryLockResources());
+    c.execute();
+    // really started, not only marked as executed
+    REQUIRE(c.pid != -1);
+    REQUIRE(c.exit_code);
+    REQUIRE(*c.exit_code == 0);
+}
+
+int main(int argc, char **argv)
+{
+    self = argv[0];
+    cl::ParseCommandLineOptions(Strings{ argv[0], "--adaptive-jobs" });
+
+    Catch::Session().run(argc, argv);
+
+    return 0;
+}